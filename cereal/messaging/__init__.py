@@ -1,6 +1,7 @@
 # must be built with scons
 from .messaging_pyx import Context, Poller, SubSocket, PubSocket, SocketEventHandle, toggle_fake_events, \
-                                set_fake_prefix, get_fake_prefix, delete_fake_prefix, wait_for_one_event
+                                set_fake_prefix, get_fake_prefix, delete_fake_prefix, wait_for_one_event, \
+                                trace_enabled, trace_publish, trace_receive
 from .messaging_pyx import MultiplePublishersError, MessagingError
 
 import os
@@ -24,6 +25,10 @@ assert wait_for_one_event
 NO_TRAVERSAL_LIMIT = 2**64-1
 AVG_FREQ_HISTORY = 100
 
+# latency tracing with CEREAL_TRACE=1, services are traced by their index in services.h
+TRACE = trace_enabled()
+SERVICE_INDEX = {s: i for i, s in enumerate(service_list)}
+
 context = Context()
 
 
@@ -227,6 +232,9 @@ class SubMaster:
       self.logMonoTime[s] = msg.logMonoTime
       self.valid[s] = msg.valid
 
+      if TRACE:
+        trace_receive(SERVICE_INDEX[s], msg.logMonoTime)
+
       if self.simulation:
         self.freq_ok[s] = True
         self.alive[s] = True
@@ -283,6 +291,9 @@ class PubMaster:
       self.sock[s] = pub_sock(s)
 
   def send(self, s: str, dat: Union[bytes, capnp.lib.capnp._DynamicStructBuilder]) -> None:
+    if TRACE:
+      log_mono_time = log_from_bytes(dat).logMonoTime if isinstance(dat, bytes) else dat.logMonoTime
+      trace_publish(SERVICE_INDEX[s], log_mono_time)
     if not isinstance(dat, bytes):
       dat = dat.to_bytes()
     self.sock[s].send(dat)
@@ -1,9 +1,15 @@
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <csignal>
+#include <cstring>
 #include <iostream>
 #include <map>
 #include <string>
+#include <vector>
+
+#include <zlib.h>
 
 typedef void (*sighandler_t)(int sig);
 
@@ -11,6 +17,34 @@ typedef void (*sighandler_t)(int sig);
 #include "cereal/messaging/impl_msgq.h"
 #include "cereal/messaging/impl_zmq.h"
 
+// usage: bridge [options]                       forwards msgq to zmq
+//        bridge [options] <ip> <service,...>    forwards zmq from ip to msgq
+//   --batch                  coalesce the messages of a service from one poll wakeup into one zmq frame
+//   --compress               zlib compress the batches, implies --batch
+//   --rate <service=hz,...>  forward at most hz messages per second of a service
+//   --decimate <service=n,...>  forward every nth message of a service
+// Batches are recognized on receive, so the zmq side needs no options.
+
+#define BATCH_MAGIC 0x31424243 // "CBB1"
+#define BATCH_COMPRESSED 1
+
+// Followed by the payload, a uint32_t size and the data for each message,
+// zlib compressed if BATCH_COMPRESSED is set
+struct BatchHeader {
+  uint32_t magic;
+  uint32_t flags;
+  uint32_t count;
+  uint32_t size; // uncompressed payload size
+};
+
+struct ForwardState {
+  PubSocket *pub;
+  uint64_t min_interval = 0; // ns, from --rate
+  int decimation = 1;
+  uint64_t last_forward = 0;
+  uint64_t count = 0;
+};
+
 std::atomic<bool> do_exit = false;
 static void set_do_exit(int sig) {
   do_exit = true;
@@ -21,11 +55,38 @@ void sigpipe_handler(int sig) {
   std::cout << "SIGPIPE received" << std::endl;
 }
 
+static uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::vector<std::string> split(const std::string &s, char delim) {
+  std::vector<std::string> r;
+  size_t start = 0;
+  while (start <= s.size()) {
+    size_t end = std::min(s.find(delim, start), s.size());
+    if (end > start) r.push_back(s.substr(start, end - start));
+    start = end + 1;
+  }
+  return r;
+}
+
+// Parses "service=value,..."
+static std::map<std::string, double> parse_service_values(const std::string &s) {
+  std::map<std::string, double> r;
+  for (auto &kv : split(s, ',')) {
+    size_t eq = kv.find('=');
+    assert(eq != std::string::npos);
+    r[kv.substr(0, eq)] = std::atof(kv.c_str() + eq + 1);
+  }
+  return r;
+}
+
 static std::vector<std::string> get_services(std::string whitelist_str, bool zmq_to_msgq) {
+  std::vector<std::string> whitelist = split(whitelist_str, ',');
   std::vector<std::string> service_list;
   for (const auto& it : services) {
     std::string name = it.name;
-    bool in_whitelist = whitelist_str.find(name) != std::string::npos;
+    bool in_whitelist = std::find(whitelist.begin(), whitelist.end(), name) != whitelist.end();
     if (name == "plusFrame" || name == "uiLayoutState" || (zmq_to_msgq && !in_whitelist)) {
       continue;
     }
@@ -34,14 +95,116 @@ static std::vector<std::string> get_services(std::string whitelist_str, bool zmq
   return service_list;
 }
 
+static bool should_forward(ForwardState &state, uint64_t t) {
+  if (state.count++ % state.decimation != 0) return false;
+  if (state.min_interval > 0) {
+    if (t - state.last_forward < state.min_interval) return false;
+    state.last_forward = t;
+  }
+  return true;
+}
+
+static int send_retry(PubSocket *pub, char *data, size_t size) {
+  int ret;
+  do {
+    ret = pub->send(data, size);
+  } while (ret == -1 && errno == EINTR && !do_exit);
+  return ret;
+}
+
+// Copies messages into a batch payload. msgq messages are leased, so they
+// have to be copied before checking the lease and forwarding them
+static void build_payload(const std::vector<MessageView> &msgs, std::vector<char> &payload) {
+  payload.clear();
+  for (auto &m : msgs) {
+    uint32_t size = m.size;
+    payload.insert(payload.end(), (const char *)&size, (const char *)&size + sizeof(size));
+    payload.insert(payload.end(), m.data, m.data + m.size);
+  }
+}
+
+static void send_batch(PubSocket *pub, uint32_t count, bool compress, const std::vector<char> &payload, std::vector<char> &frame) {
+  BatchHeader header = {BATCH_MAGIC, compress ? BATCH_COMPRESSED : 0u, count, (uint32_t)payload.size()};
+  uLongf payload_size = payload.size();
+  frame.resize(sizeof(header) + (compress ? compressBound(payload.size()) : payload.size()));
+  if (compress) {
+    int err = compress2((Bytef *)frame.data() + sizeof(header), &payload_size, (const Bytef *)payload.data(), payload.size(), Z_BEST_SPEED);
+    assert(err == Z_OK);
+  } else {
+    memcpy(frame.data() + sizeof(header), payload.data(), payload.size());
+  }
+  memcpy(frame.data(), &header, sizeof(header));
+
+  int ret = send_retry(pub, frame.data(), sizeof(header) + payload_size);
+  assert(ret >= 0 || do_exit);
+}
+
+// Republishes the messages of a batch one by one, returns false if msg isn't a batch
+static bool unbatch(ForwardState &state, Message *msg, std::vector<char> &payload) {
+  BatchHeader header;
+  if (msg->getSize() < sizeof(header)) return false;
+  memcpy(&header, msg->getData(), sizeof(header));
+  if (header.magic != BATCH_MAGIC) return false;
+
+  const char *data = msg->getData() + sizeof(header);
+  size_t size = msg->getSize() - sizeof(header);
+  if (header.flags & BATCH_COMPRESSED) {
+    // A batch is what queued up in a msgq queue, it can't be larger than one
+    if (header.size > DEFAULT_SEGMENT_SIZE) {
+      std::cout << "Warning, dropping batch of " << header.size << " bytes" << std::endl;
+      return true;
+    }
+    payload.resize(header.size);
+    uLongf payload_size = payload.size();
+    if (uncompress((Bytef *)payload.data(), &payload_size, (const Bytef *)data, size) != Z_OK || payload_size != header.size) {
+      std::cout << "Warning, dropping corrupt batch" << std::endl;
+      return true;
+    }
+    data = payload.data();
+    size = payload_size;
+  }
+
+  uint64_t t = now_ns();
+  for (uint32_t i = 0; i < header.count && size >= sizeof(uint32_t); i++) {
+    uint32_t msg_size;
+    memcpy(&msg_size, data, sizeof(msg_size));
+    if (size - sizeof(msg_size) < msg_size) break;
+    if (should_forward(state, t)) {
+      int ret = send_retry(state.pub, (char *)data + sizeof(msg_size), msg_size);
+      assert(ret >= 0 || do_exit);
+    }
+    data += sizeof(msg_size) + msg_size;
+    size -= sizeof(msg_size) + msg_size;
+  }
+  return true;
+}
+
 int main(int argc, char** argv) {
   signal(SIGPIPE, (sighandler_t)sigpipe_handler);
   signal(SIGINT, (sighandler_t)set_do_exit);
   signal(SIGTERM, (sighandler_t)set_do_exit);
 
-  bool zmq_to_msgq = argc > 2;
-  std::string ip = zmq_to_msgq ? argv[1] : "127.0.0.1";
-  std::string whitelist_str = zmq_to_msgq ? std::string(argv[2]) : "";
+  bool batch = false, compress = false;
+  std::map<std::string, double> rates, decimations;
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--batch") {
+      batch = true;
+    } else if (arg == "--compress") {
+      batch = compress = true;
+    } else if (arg == "--rate" && i + 1 < argc) {
+      rates = parse_service_values(argv[++i]);
+    } else if (arg == "--decimate" && i + 1 < argc) {
+      decimations = parse_service_values(argv[++i]);
+    } else {
+      args.push_back(arg);
+    }
+  }
+
+  bool zmq_to_msgq = args.size() > 1;
+  std::string ip = zmq_to_msgq ? args[0] : "127.0.0.1";
+  std::string whitelist_str = zmq_to_msgq ? args[1] : "";
 
   Poller *poller;
   Context *pub_context;
@@ -56,7 +219,7 @@ int main(int argc, char** argv) {
     sub_context = new MSGQContext();
   }
 
-  std::map<SubSocket*, PubSocket*> sub2pub;
+  std::map<SubSocket*, ForwardState> sub2pub;
   for (auto endpoint : get_services(whitelist_str, zmq_to_msgq)) {
     PubSocket * pub_sock;
     SubSocket * sub_sock;
@@ -71,19 +234,54 @@ int main(int argc, char** argv) {
     sub_sock->connect(sub_context, endpoint, ip, false);
 
     poller->registerSocket(sub_sock);
-    sub2pub[sub_sock] = pub_sock;
+    ForwardState &state = sub2pub[sub_sock];
+    state.pub = pub_sock;
+    if (rates.count(endpoint) && rates[endpoint] > 0) state.min_interval = 1e9 / rates[endpoint];
+    if (decimations.count(endpoint)) state.decimation = std::max(1, (int)decimations[endpoint]);
   }
 
+  std::vector<MessageView> msgs, forward;
+  std::vector<char> payload, frame;
   while (!do_exit) {
     for (auto sub_sock : poller->poll(100)) {
-      Message * msg = sub_sock->receive();
-      if (msg == NULL) continue;
-      int ret;
-      do {
-        ret = sub2pub[sub_sock]->sendMessage(msg);
-      } while (ret == -1 && errno == EINTR && !do_exit);
-      assert(ret >= 0 || do_exit);
-      delete msg;
+      ForwardState &state = sub2pub[sub_sock];
+      if (zmq_to_msgq) {
+        Message * msg = sub_sock->receive(true);
+        if (msg == NULL) continue;
+        if (!unbatch(state, msg, payload) && should_forward(state, now_ns())) {
+          int ret = send_retry(state.pub, msg->getData(), msg->getSize());
+          assert(ret >= 0 || do_exit);
+        }
+        delete msg;
+      } else {
+        // Everything that queued up since the last wakeup
+        if (sub_sock->receiveBatch(&msgs) == 0) continue;
+
+        uint64_t t = now_ns();
+        forward.clear();
+        for (auto &m : msgs) {
+          if (should_forward(state, t)) forward.push_back(m);
+        }
+        if (forward.empty()) continue;
+
+        // Copy out before forwarding, a publisher lapping us could change the data while it's being sent
+        build_payload(forward, payload);
+        if (!sub_sock->leaseValid()) {
+          std::cout << "Warning, dropping " << forward.size() << " messages, overwritten while draining" << std::endl;
+          continue;
+        }
+
+        if (batch) {
+          send_batch(state.pub, forward.size(), compress, payload, frame);
+        } else {
+          const char *data = payload.data();
+          for (auto &m : forward) {
+            int ret = send_retry(state.pub, (char *)data + sizeof(uint32_t), m.size);
+            assert(ret >= 0 || do_exit);
+            data += sizeof(uint32_t) + m.size;
+          }
+        }
+      }
 
       if (do_exit) break;
     }
@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "cereal/messaging/messaging.h"
+
+// Allocations and build + serialize time of a fresh MessageBuilder per message
+// versus a PooledMessageBuilder, for a modelV2 and a can message with 64 frames.
+//
+// usage: builder_bench [iterations]
+
+#ifdef __GLIBC__
+// Count every heap allocation, capnp gets its segments straight from calloc
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+static std::atomic<uint64_t> allocations = 0;
+extern "C" void *malloc(size_t size) {
+  allocations++;
+  return __libc_malloc(size);
+}
+extern "C" void *calloc(size_t n, size_t size) {
+  allocations++;
+  return __libc_calloc(n, size);
+}
+extern "C" void *realloc(void *ptr, size_t size) {
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+#else
+static std::atomic<uint64_t> allocations = 0;
+#endif
+
+const int TRAJECTORY_SIZE = 33;
+const int CAN_FRAMES = 64;
+
+static uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void fill_xyzt(cereal::XYZTData::Builder xyzt, const std::vector<float> &v) {
+  auto arr = kj::ArrayPtr<const float>(v.data(), v.size());
+  xyzt.setX(arr);
+  xyzt.setY(arr);
+  xyzt.setZ(arr);
+  xyzt.setT(arr);
+  xyzt.setXStd(arr);
+  xyzt.setYStd(arr);
+  xyzt.setZStd(arr);
+}
+
+// Roughly the shape of what modeld publishes
+static void build_model(MessageBuilder &msg, const std::vector<float> &v) {
+  auto framed = msg.initEvent().initModelV2();
+  framed.setFrameId(1);
+  fill_xyzt(framed.initPosition(), v);
+  fill_xyzt(framed.initOrientation(), v);
+  fill_xyzt(framed.initVelocity(), v);
+  fill_xyzt(framed.initOrientationRate(), v);
+  fill_xyzt(framed.initAcceleration(), v);
+
+  auto lane_lines = framed.initLaneLines(4);
+  for (int i = 0; i < 4; i++) fill_xyzt(lane_lines[i], v);
+  framed.setLaneLineProbs(kj::ArrayPtr<const float>(v.data(), 4));
+  framed.setLaneLineStds(kj::ArrayPtr<const float>(v.data(), 4));
+
+  auto road_edges = framed.initRoadEdges(2);
+  for (int i = 0; i < 2; i++) fill_xyzt(road_edges[i], v);
+  framed.setRoadEdgeStds(kj::ArrayPtr<const float>(v.data(), 2));
+
+  auto leads = framed.initLeadsV3(3);
+  auto lead_v = kj::ArrayPtr<const float>(v.data(), 6);
+  for (int i = 0; i < 3; i++) {
+    leads[i].setProb(0.5);
+    leads[i].setT(lead_v);
+    leads[i].setX(lead_v);
+    leads[i].setXStd(lead_v);
+    leads[i].setY(lead_v);
+    leads[i].setYStd(lead_v);
+    leads[i].setV(lead_v);
+    leads[i].setVStd(lead_v);
+    leads[i].setA(lead_v);
+    leads[i].setAStd(lead_v);
+  }
+}
+
+static void build_can(MessageBuilder &msg, const std::vector<uint8_t> &dat) {
+  auto can = msg.initEvent().initCan(CAN_FRAMES);
+  for (int i = 0; i < CAN_FRAMES; i++) {
+    can[i].setAddress(0x100 + i);
+    can[i].setBusTime(i);
+    can[i].setDat(kj::arrayPtr(dat.data(), dat.size()));
+    can[i].setSrc(i % 3);
+  }
+}
+
+struct BenchResult {
+  double allocs_per_msg;
+  std::vector<uint64_t> latencies;
+  size_t size;
+};
+
+template <typename Build>
+static BenchResult run(int iterations, bool pooled, Build build) {
+  BenchResult res;
+  res.latencies.reserve(iterations);
+  std::vector<unsigned char> out(1024 * 1024);
+  PooledMessageBuilder pool;
+
+  // Warm up, the pool learns its segment size here
+  for (int i = 0; i < 10; i++) {
+    MessageBuilder &msg = pool.reset();
+    build(msg);
+  }
+
+  uint64_t allocs_start = allocations;
+  for (int i = 0; i < iterations; i++) {
+    uint64_t t = now_ns();
+    if (pooled) {
+      MessageBuilder &msg = pool.reset();
+      build(msg);
+      res.size = msg.serializeToBuffer(out.data(), out.size());
+    } else {
+      MessageBuilder msg;
+      build(msg);
+      res.size = msg.serializeToBuffer(out.data(), out.size());
+    }
+    res.latencies.push_back(now_ns() - t);
+  }
+  res.allocs_per_msg = (double)(allocations - allocs_start) / iterations;
+  std::sort(res.latencies.begin(), res.latencies.end());
+  return res;
+}
+
+static double percentile(const std::vector<uint64_t> &sorted, double p) {
+  if (sorted.empty()) return 0;
+  return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))] * 1e-3;
+}
+
+int main(int argc, char **argv) {
+  int iterations = argc > 1 ? std::atoi(argv[1]) : 100000;
+
+  std::vector<float> v(TRAJECTORY_SIZE, 1.0);
+  std::vector<uint8_t> dat(8, 0xAB);
+  auto model = [&](MessageBuilder &msg) { build_model(msg, v); };
+  auto can = [&](MessageBuilder &msg) { build_can(msg, dat); };
+
+  printf("%-8s %-8s %8s %12s %9s %9s %9s\n", "MSG", "BUILDER", "SIZE", "ALLOCS/MSG", "P50_US", "P99_US", "MAX_US");
+  for (bool pooled : {false, true}) {
+    for (auto &[name, res] : {std::pair{"modelV2", run(iterations, pooled, model)},
+                              std::pair{"can", run(iterations, pooled, can)}}) {
+      printf("%-8s %-8s %8zu %12.2f %9.2f %9.2f %9.2f\n", name, pooled ? "pooled" : "malloc", res.size, res.allocs_per_msg,
+             percentile(res.latencies, 0.5), percentile(res.latencies, 0.99), percentile(res.latencies, 1.0));
+    }
+  }
+  return 0;
+}
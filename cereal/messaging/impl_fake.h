@@ -20,6 +20,7 @@ private:
   Event *recv_called = nullptr;
   Event *recv_ready = nullptr;
   EventState *state = nullptr;
+  bool in_batch = false;
 
 public:
   FakeSubSocket(): TSubSocket() {}
@@ -46,7 +47,7 @@ public:
   }
 
   Message *receive(bool non_blocking=false) override {
-    if (this->state->enabled) {
+    if (this->state->enabled && !this->in_batch) {
       this->recv_called->set();
       this->recv_ready->wait();
       this->recv_ready->clear();
@@ -54,6 +55,30 @@ public:
 
     return TSubSocket::receive(non_blocking);
   }
+
+  bool receiveLease(const char **data, size_t *size, bool non_blocking=false) override {
+    if (this->state->enabled) {
+      this->recv_called->set();
+      this->recv_ready->wait();
+      this->recv_ready->clear();
+    }
+
+    return TSubSocket::receiveLease(data, size, non_blocking);
+  }
+
+  size_t receiveBatch(std::vector<MessageView> *msgs, size_t max_msgs=SIZE_MAX) override {
+    if (this->state->enabled) {
+      this->recv_called->set();
+      this->recv_ready->wait();
+      this->recv_ready->clear();
+    }
+
+    // The default implementation calls receive, it shouldn't wait again
+    this->in_batch = true;
+    size_t r = TSubSocket::receiveBatch(msgs, max_msgs);
+    this->in_batch = false;
+    return r;
+  }
 };
 
 class FakePoller: public Poller {
@@ -67,7 +67,7 @@ int MSGQSubSocket::connect(Context *context, std::string endpoint, std::string a
     std::cout << "Warning, " << std::string(endpoint) << " is not in service list." << std::endl;
   }
 
-  q = new msgq_queue_t;
+  q = new msgq_queue_t();
   int r = msgq_new_queue(q, endpoint.c_str(), DEFAULT_SEGMENT_SIZE);
   if (r != 0){
     return r;
@@ -141,6 +141,75 @@ Message * MSGQSubSocket::receive(bool non_blocking){
   return (Message*)r;
 }
 
+bool MSGQSubSocket::receiveLease(const char **data, size_t *size, bool non_blocking){
+  msgq_do_exit = 0;
+
+  void (*prev_handler_sigint)(int);
+  void (*prev_handler_sigterm)(int);
+  if (!non_blocking){
+    prev_handler_sigint = std::signal(SIGINT, sig_handler);
+    prev_handler_sigterm = std::signal(SIGTERM, sig_handler);
+  }
+
+  msgq_msg_t msg;
+  int rc = msgq_msg_recv_lease(&msg, q);
+
+  // Same blocking loop as receive
+  while (!non_blocking && rc == 0 && msgq_do_exit == 0){
+    msgq_pollitem_t items[1];
+    items[0].q = q;
+
+    int t = (timeout != -1) ? timeout : 100;
+
+    int n = msgq_poll(items, 1, t);
+    rc = msgq_msg_recv_lease(&msg, q);
+
+    // The poll indicated a message was ready, but the receive failed. Try again
+    if (n == 1 && rc == 0){
+      continue;
+    }
+
+    if (timeout != -1){
+      break;
+    }
+  }
+
+  if (!non_blocking){
+    std::signal(SIGINT, prev_handler_sigint);
+    std::signal(SIGTERM, prev_handler_sigterm);
+  }
+
+  errno = msgq_do_exit ? EINTR : 0;
+
+  if (rc > 0 && msgq_do_exit){
+    msgq_lease_release(q); // Drop unused lease on exit
+    return false;
+  }
+
+  if (rc <= 0){
+    return false;
+  }
+
+  *data = msg.data;
+  *size = msg.size;
+  return true;
+}
+
+size_t MSGQSubSocket::receiveBatch(std::vector<MessageView> *msgs, size_t max_msgs){
+  msgs->clear();
+
+  int rc = msgq_msg_recv_batch(&batch, max_msgs, q);
+  for (int i = 0; i < rc; i++){
+    msgs->push_back({batch[i].data, batch[i].size});
+  }
+
+  return msgs->size();
+}
+
+bool MSGQSubSocket::leaseValid(){
+  return msgq_lease_valid(q);
+}
+
 void MSGQSubSocket::setTimeout(int t){
   timeout = t;
 }
@@ -159,7 +228,7 @@ int MSGQPubSocket::connect(Context *context, std::string endpoint, bool check_en
     std::cout << "Warning, " << std::string(endpoint) << " is not in service list." << std::endl;
   }
 
-  q = new msgq_queue_t;
+  q = new msgq_queue_t();
   int r = msgq_new_queue(q, endpoint.c_str(), DEFAULT_SEGMENT_SIZE);
   if (r != 0){
     return r;
@@ -186,6 +255,14 @@ int MSGQPubSocket::send(char *data, size_t size){
   return msgq_msg_send(&msg, q);
 }
 
+char * MSGQPubSocket::reserve(size_t size){
+  return msgq_msg_reserve(q, size);
+}
+
+int MSGQPubSocket::commit(size_t size){
+  return msgq_msg_commit(q, size);
+}
+
 bool MSGQPubSocket::all_readers_updated() {
   return msgq_all_readers_updated(q);
 }
@@ -198,23 +275,44 @@ MSGQPubSocket::~MSGQPubSocket(){
 }
 
 
-void MSGQPoller::registerSocket(SubSocket * socket){
-  assert(num_polls + 1 < MAX_POLLERS);
-  polls[num_polls].q = (msgq_queue_t*)socket->getRawSocket();
+MSGQPoller::MSGQPoller(){
+  msgq_waitset_init(&waitset);
+}
 
+void MSGQPoller::registerSocket(SubSocket * socket){
+  assert(sockets.size() + 1 < MAX_POLLERS);
+  msgq_queue_t *q = (msgq_queue_t*)socket->getRawSocket();
+  polls.push_back({q, 0});
   sockets.push_back(socket);
-  num_polls++;
+
+  if (use_waitset && msgq_waitset_add(&waitset, q) < 0){
+    // Fall back to polling every socket, the wait set would never report this one
+    std::cout << "Warning, could not add " << q->endpoint << " to the wait set, falling back to msgq_poll" << std::endl;
+    msgq_waitset_close(&waitset);
+    use_waitset = false;
+  }
 }
 
 std::vector<SubSocket*> MSGQPoller::poll(int timeout){
   std::vector<SubSocket*> r;
 
-  msgq_poll(polls, num_polls, timeout);
-  for (size_t i = 0; i < num_polls; i++){
-    if (polls[i].revents){
+  if (use_waitset){
+    msgq_waitset_wait(&waitset, &ready, timeout);
+    for (size_t i : ready){
       r.push_back(sockets[i]);
     }
+  } else {
+    msgq_poll(polls.data(), polls.size(), timeout);
+    for (size_t i = 0; i < polls.size(); i++){
+      if (polls[i].revents){
+        r.push_back(sockets[i]);
+      }
+    }
   }
 
   return r;
 }
+
+MSGQPoller::~MSGQPoller(){
+  msgq_waitset_close(&waitset);
+}
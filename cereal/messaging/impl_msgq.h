@@ -35,11 +35,15 @@ class MSGQSubSocket : public SubSocket {
 private:
   msgq_queue_t * q = NULL;
   int timeout;
+  std::vector<msgq_msg_t> batch;
 public:
   int connect(Context *context, std::string endpoint, std::string address, bool conflate=false, bool check_endpoint=true);
   void setTimeout(int timeout);
   void * getRawSocket() {return (void*)q;}
   Message *receive(bool non_blocking=false);
+  bool receiveLease(const char **data, size_t *size, bool non_blocking=false);
+  size_t receiveBatch(std::vector<MessageView> *msgs, size_t max_msgs=SIZE_MAX);
+  bool leaseValid();
   ~MSGQSubSocket();
 };
 
@@ -50,6 +54,8 @@ public:
   int connect(Context *context, std::string endpoint, bool check_endpoint=true);
   int sendMessage(Message *message);
   int send(char *data, size_t size);
+  char *reserve(size_t size);
+  int commit(size_t size);
   bool all_readers_updated();
   ~MSGQPubSocket();
 };
@@ -57,11 +63,14 @@ public:
 class MSGQPoller : public Poller {
 private:
   std::vector<SubSocket*> sockets;
-  msgq_pollitem_t polls[MAX_POLLERS];
-  size_t num_polls = 0;
+  msgq_waitset_t waitset;
+  std::vector<size_t> ready;
+  bool use_waitset = true;
+  std::vector<msgq_pollitem_t> polls; // used instead of the wait set if a socket couldn't be added
 
 public:
+  MSGQPoller();
   void registerSocket(SubSocket *socket);
   std::vector<SubSocket*> poll(int timeout);
-  ~MSGQPoller(){};
+  ~MSGQPoller();
 };
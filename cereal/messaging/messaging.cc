@@ -71,6 +71,70 @@ SubSocket * SubSocket::create(Context * context, std::string endpoint, std::stri
   }
 }
 
+bool SubSocket::receiveLease(const char **data, size_t *size, bool non_blocking){
+  Message *msg = receive(non_blocking);
+  if (msg == nullptr){
+    return false;
+  }
+
+  releaseLease();
+  leased_msg_ = msg;
+
+  *data = msg->getData();
+  *size = msg->getSize();
+  return true;
+}
+
+size_t SubSocket::receiveBatch(std::vector<MessageView> *msgs, size_t max_msgs){
+  msgs->clear();
+
+  std::vector<Message *> batch;
+  while (batch.size() < max_msgs){
+    Message *msg = receive(true);
+    if (msg == nullptr){
+      break;
+    }
+    batch.push_back(msg);
+  }
+
+  // Keep the previous lease when nothing arrived, it may still be read in place
+  if (batch.empty()){
+    return 0;
+  }
+
+  releaseLease();
+  leased_batch_.swap(batch);
+
+  for (auto msg : leased_batch_){
+    msgs->push_back({msg->getData(), msg->getSize()});
+  }
+  return msgs->size();
+}
+
+void SubSocket::releaseLease(){
+  delete leased_msg_;
+  leased_msg_ = nullptr;
+
+  for (auto msg : leased_batch_){
+    delete msg;
+  }
+  leased_batch_.clear();
+}
+
+SubSocket::~SubSocket(){
+  releaseLease();
+}
+
+char * PubSocket::reserve(size_t size){
+  reserved_buf_.resize(size / sizeof(capnp::word) + 1);
+  return (char *)reserved_buf_.data();
+}
+
+int PubSocket::commit(size_t size){
+  assert(size <= reserved_buf_.size() * sizeof(capnp::word));
+  return send((char *)reserved_buf_.data(), size);
+}
+
 PubSocket * PubSocket::create(){
   PubSocket * s;
   if (messaging_use_zmq()){
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 #include <map>
+#include <optional>
 #include <string>
 #include <vector>
 #include <utility>
@@ -17,6 +19,9 @@
 
 #define MSG_MULTIPLE_PUBLISHERS 100
 
+// Index of a service in cereal/services.h
+enum class ServiceId : int;
+
 bool messaging_use_zmq();
 
 class Context {
@@ -37,15 +42,32 @@ public:
 };
 
 
+struct MessageView {
+  const char *data;
+  size_t size;
+};
+
 class SubSocket {
 public:
   virtual int connect(Context *context, std::string endpoint, std::string address, bool conflate=false, bool check_endpoint=true) = 0;
   virtual void setTimeout(int timeout) = 0;
   virtual Message *receive(bool non_blocking=false) = 0;
+  // Zero-copy receive. data stays owned by the socket until the next receiveLease,
+  // leaseValid() tells if it was overwritten since. Backends without shared memory copy.
+  virtual bool receiveLease(const char **data, size_t *size, bool non_blocking=false);
+  // Lease all pending messages in one go, without blocking. Same lifetime as receiveLease,
+  // leaseValid() covers the whole batch.
+  virtual size_t receiveBatch(std::vector<MessageView> *msgs, size_t max_msgs=SIZE_MAX);
+  virtual bool leaseValid() { return leased_msg_ != nullptr || !leased_batch_.empty(); }
   virtual void * getRawSocket() = 0;
   static SubSocket * create();
   static SubSocket * create(Context * context, std::string endpoint, std::string address="127.0.0.1", bool conflate=false, bool check_endpoint=true);
-  virtual ~SubSocket(){};
+  virtual ~SubSocket();
+
+protected:
+  void releaseLease();
+  Message *leased_msg_ = nullptr;
+  std::vector<Message *> leased_batch_;
 };
 
 class PubSocket {
@@ -53,11 +75,18 @@ public:
   virtual int connect(Context *context, std::string endpoint, bool check_endpoint=true) = 0;
   virtual int sendMessage(Message *message) = 0;
   virtual int send(char *data, size_t size) = 0;
+  // In-place send. reserve returns a buffer of at least size bytes (nullptr on error),
+  // commit publishes the first size bytes of it. Backends without shared memory copy.
+  virtual char *reserve(size_t size);
+  virtual int commit(size_t size);
   virtual bool all_readers_updated() = 0;
   static PubSocket * create();
   static PubSocket * create(Context * context, std::string endpoint, bool check_endpoint=true);
   static PubSocket * create(Context * context, std::string endpoint, int port, bool check_endpoint=true);
   virtual ~PubSocket(){};
+
+protected:
+  std::vector<capnp::word> reserved_buf_;
 };
 
 class Poller {
@@ -69,10 +98,13 @@ public:
   virtual ~Poller(){};
 };
 
+// Services in no_conflate get every message instead of only the latest one. received() then
+// has all messages since the last update in order, at most queue_size, the oldest are dropped.
 class SubMaster {
 public:
   SubMaster(const std::vector<const char *> &service_list, const std::vector<const char *> &poll = {},
-            const char *address = nullptr, const std::vector<const char *> &ignore_alive = {});
+            const char *address = nullptr, const std::vector<const char *> &ignore_alive = {},
+            const std::vector<const char *> &no_conflate = {}, size_t queue_size = 100);
   void update(int timeout = 1000);
   void update_msgs(uint64_t current_time, const std::vector<std::pair<std::string, cereal::Event::Reader>> &messages);
   inline bool allAlive(const std::vector<const char *> &service_list = {}) { return all_(service_list, false, true); }
@@ -88,18 +120,39 @@ public:
   uint64_t rcv_frame(const char *name) const;
   uint64_t rcv_time(const char *name) const;
   cereal::Event::Reader &operator[](const char *name) const;
+  // Messages of the last update, oldest first. operator[] is the newest of them.
+  const std::vector<cereal::Event::Reader> &received(const char *name) const;
+  // Messages that didn't fit the queue since the start
+  uint64_t dropped(const char *name) const;
+
+  // Same as above without the name lookup, for hot loops
+  bool updated(ServiceId id) const;
+  bool alive(ServiceId id) const;
+  bool valid(ServiceId id) const;
+  uint64_t rcv_frame(ServiceId id) const;
+  uint64_t rcv_time(ServiceId id) const;
+  cereal::Event::Reader &operator[](ServiceId id) const;
+  const std::vector<cereal::Event::Reader> &received(ServiceId id) const;
+  uint64_t dropped(ServiceId id) const;
 
 private:
+  struct SubMessage;
   bool all_(const std::vector<const char *> &service_list, bool valid, bool alive);
+  void apply_msgs(uint64_t current_time, const std::vector<std::pair<SubMessage *, cereal::Event::Reader>> &messages);
+  SubMessage *get(ServiceId id) const;
+  SubMessage *get(const char *name) const;
   Poller *poller_ = nullptr;
-  struct SubMessage;
-  std::map<SubSocket *, SubMessage *> messages_;
-  std::map<std::string, SubMessage *> services_;
+  std::vector<SubMessage *> messages_;  // in subscription order
+  std::vector<SubMessage *> services_;  // indexed by ServiceId, nullptr if not subscribed
+  std::map<SubSocket *, SubMessage *> sockets_;
+  std::vector<MessageView> batch_;
 };
 
 class MessageBuilder : public capnp::MallocMessageBuilder {
 public:
   MessageBuilder() = default;
+  // Builds into first_segment, which must be zeroed. The used part is zeroed again on destruction.
+  MessageBuilder(kj::ArrayPtr<capnp::word> first_segment) : capnp::MallocMessageBuilder(first_segment) {}
 
   cereal::Event::Builder initEvent(bool valid = true) {
     cereal::Event::Builder event = initRoot<cereal::Event>();
@@ -132,15 +185,41 @@ private:
   kj::Array<capnp::word> heapArray_;
 };
 
+// Reuses the first segment of a MessageBuilder across messages. The segment grows
+// to fit the largest message built so far, so a producer that keeps one around
+// doesn't allocate per message once it has seen its largest message.
+//
+//   MessageBuilder &msg = pool.reset();
+//   msg.initEvent().initCan(n);
+//   pm.send("can", msg);
+class PooledMessageBuilder {
+public:
+  PooledMessageBuilder(size_t initial_size = 4096);
+  // Finishes the previous message and starts a new one
+  MessageBuilder &reset();
+  // Serializes the current message into a reused buffer, valid until the next call
+  kj::ArrayPtr<capnp::byte> toBytes();
+  inline size_t segmentSize() const { return segment_.size() * sizeof(capnp::word); }
+
+private:
+  kj::Array<capnp::word> segment_;
+  kj::Array<capnp::word> bytes_;
+  std::optional<MessageBuilder> msg_;
+};
+
 class PubMaster {
 public:
   PubMaster(const std::vector<const char *> &service_list);
-  inline int send(const char *name, capnp::byte *data, size_t size) { return sockets_.at(name)->send((char *)data, size); }
+  int send(const char *name, capnp::byte *data, size_t size);
   int send(const char *name, MessageBuilder &msg);
+  int send(ServiceId id, capnp::byte *data, size_t size);
+  int send(ServiceId id, MessageBuilder &msg);
   ~PubMaster();
 
 private:
-  std::map<std::string, PubSocket *> sockets_;
+  PubSocket *get(ServiceId id) const;
+  PubSocket *get(const char *name) const;
+  std::vector<PubSocket *> sockets_;  // indexed by ServiceId, nullptr if not published
 };
 
 class AlignedBuffer {
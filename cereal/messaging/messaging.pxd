@@ -4,6 +4,7 @@
 from libcpp.string cimport string
 from libcpp.vector cimport vector
 from libcpp cimport bool
+from libc.stdint cimport uint64_t
 
 
 cdef extern from "cereal/messaging/impl_fake.h":
@@ -66,3 +67,9 @@ cdef extern from "cereal/messaging/messaging.h":
     Poller * create()
     void registerSocket(SubSocket *)
     vector[SubSocket*] poll(int) nogil
+
+
+cdef extern from "cereal/messaging/trace.h":
+  bool trace_enabled()
+  void trace_publish(int, uint64_t)
+  void trace_receive(int, uint64_t)
@@ -0,0 +1,266 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdexcept>
+
+#include <sys/resource.h>
+
+#include "cereal/messaging/messaging.h"
+#include "cereal/messaging/impl_msgq.h"
+#include "cereal/messaging/impl_zmq.h"
+#include "cereal/messaging/impl_fake.h"
+
+// Throughput, latency and CPU benchmark of the messaging backends.
+// Sweeps all combinations of the given backends, message sizes, reader counts,
+// conflate settings and publisher rates (0 is as fast as possible).
+//
+// usage: messaging_bench [--json] [--duration s] [--backends msgq,zmq,fake]
+//                        [--sizes 64,1024] [--readers 1,4] [--conflate 0,1] [--rates 100,0]
+
+// msgq and fake don't need a service, zmq needs one to get a port
+const char *MSGQ_ENDPOINT = "messaging_bench";
+const char *ZMQ_ENDPOINT = "testJoystick";
+
+struct BenchCase {
+  std::string backend;
+  size_t size;
+  int readers;
+  bool conflate;
+  int rate;
+};
+
+struct BenchResult {
+  uint64_t sent = 0;
+  uint64_t received = 0;
+  double duration = 0;
+  double cpu = 0;
+  std::vector<uint64_t> latencies;
+};
+
+static uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double cpu_seconds() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+}
+
+static std::vector<std::string> split(const std::string &s) {
+  std::vector<std::string> r;
+  size_t start = 0;
+  while (start <= s.size()) {
+    size_t end = s.find(',', start);
+    if (end == std::string::npos) end = s.size();
+    if (end > start) r.push_back(s.substr(start, end - start));
+    start = end + 1;
+  }
+  return r;
+}
+
+static std::vector<int> split_int(const std::string &s) {
+  std::vector<int> r;
+  for (auto &v : split(s)) r.push_back(std::atoi(v.c_str()));
+  return r;
+}
+
+static BenchResult run_case(const BenchCase &c, double duration) {
+  std::string endpoint = c.backend == "zmq" ? ZMQ_ENDPOINT : MSGQ_ENDPOINT;
+  Context *context = c.backend == "zmq" ? (Context *)new ZMQContext() : (Context *)new MSGQContext();
+
+  PubSocket *pub = c.backend == "zmq" ? (PubSocket *)new ZMQPubSocket() : (PubSocket *)new MSGQPubSocket();
+  int r = pub->connect(context, endpoint, false);
+  assert(r == 0);
+
+  // Fake sockets wait for a controller to acknowledge every receive, like process replay does
+  std::vector<SocketEventHandle *> fake_handles;
+  std::vector<SubSocket *> subs;
+  for (int i = 0; i < c.readers; i++) {
+    SubSocket *sub;
+    if (c.backend == "fake") {
+      std::string identifier = "messaging_bench_" + std::to_string(i);
+      fake_handles.push_back(new SocketEventHandle(endpoint, identifier));
+      fake_handles.back()->set_enabled(true);
+      SocketEventHandle::set_fake_prefix(identifier);
+      sub = new FakeSubSocket<MSGQSubSocket>();
+    } else if (c.backend == "zmq") {
+      sub = new ZMQSubSocket();
+    } else {
+      sub = new MSGQSubSocket();
+    }
+    r = sub->connect(context, endpoint, "127.0.0.1", c.conflate, false);
+    assert(r == 0);
+    sub->setTimeout(100);
+    subs.push_back(sub);
+  }
+  SocketEventHandle::set_fake_prefix("");
+
+  // zmq subscriptions need a moment to be set up
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  std::atomic<bool> done = false, controllers_done = false;
+  std::vector<BenchResult> reader_results(c.readers);
+  std::vector<std::thread> threads, controllers;
+
+  for (auto handle : fake_handles) {
+    controllers.emplace_back([&controllers_done, handle]() {
+      Event recv_called = handle->recv_called(), recv_ready = handle->recv_ready();
+      while (!controllers_done) {
+        try {
+          recv_called.wait(1);
+        } catch (std::runtime_error &) {
+          continue;
+        }
+        recv_called.clear();
+        recv_ready.set();
+      }
+    });
+  }
+
+  for (int i = 0; i < c.readers; i++) {
+    threads.emplace_back([&done, &reader_results, &subs, i]() {
+      BenchResult &res = reader_results[i];
+      while (!done) {
+        Message *msg = subs[i]->receive();
+        if (msg == nullptr) continue;
+
+        uint64_t t = now_ns();
+        uint64_t sent_t;
+        memcpy(&sent_t, msg->getData(), sizeof(sent_t));
+        res.latencies.push_back(t - sent_t);
+        res.received++;
+        delete msg;
+      }
+    });
+  }
+
+  BenchResult result;
+  std::vector<char> buf(std::max(c.size, sizeof(uint64_t)));
+  double cpu_start = cpu_seconds();
+  uint64_t start = now_ns();
+  uint64_t end = start + duration * 1e9;
+  uint64_t next = start;
+  while (now_ns() < end) {
+    uint64_t t = now_ns();
+    memcpy(buf.data(), &t, sizeof(t));
+    pub->send(buf.data(), buf.size());
+    result.sent++;
+
+    if (c.rate > 0) {
+      next += 1e9 / c.rate;
+      std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::nanoseconds(next)));
+    }
+  }
+  result.duration = (now_ns() - start) * 1e-9;
+
+  // Let the readers catch up
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  done = true;
+  for (auto &t : threads) t.join();
+  controllers_done = true;
+  for (auto &t : controllers) t.join();
+  result.cpu = cpu_seconds() - cpu_start;
+
+  for (auto &res : reader_results) {
+    result.received += res.received;
+    result.latencies.insert(result.latencies.end(), res.latencies.begin(), res.latencies.end());
+  }
+  std::sort(result.latencies.begin(), result.latencies.end());
+
+  for (auto s : subs) delete s;
+  for (auto h : fake_handles) delete h;
+  delete pub;
+  delete context;
+  return result;
+}
+
+static double percentile(const std::vector<uint64_t> &sorted, double p) {
+  if (sorted.empty()) return 0;
+  return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))] * 1e-3;
+}
+
+int main(int argc, char **argv) {
+  bool json = false;
+  double duration = 2.0;
+  std::vector<std::string> backends = {"msgq", "zmq", "fake"};
+  std::vector<int> sizes = {64, 1024, 16384, 262144};
+  std::vector<int> readers = {1, 4, NUM_READERS};
+  std::vector<int> conflates = {0, 1};
+  std::vector<int> rates = {100, 1000, 0};
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    std::string val = i + 1 < argc ? argv[i + 1] : "";
+    if (arg == "--json") {
+      json = true;
+      continue;
+    }
+
+    if (arg == "--duration") duration = std::atof(val.c_str());
+    else if (arg == "--backends") backends = split(val);
+    else if (arg == "--sizes") sizes = split_int(val);
+    else if (arg == "--readers") readers = split_int(val);
+    else if (arg == "--conflate") conflates = split_int(val);
+    else if (arg == "--rates") rates = split_int(val);
+    else {
+      fprintf(stderr, "unknown argument %s\n", arg.c_str());
+      return 1;
+    }
+    i++;
+  }
+
+  if (json) {
+    printf("[\n");
+  } else {
+    printf("%-5s %8s %7s %8s %6s %10s %10s %9s %9s %9s %9s %11s\n", "BACK", "SIZE", "READERS", "CONFLATE", "RATE",
+           "SENT/S", "RECV/S", "P50_US", "P99_US", "P999_US", "MAX_US", "CPU_US/MSG");
+  }
+
+  bool first = true;
+  for (auto &backend : backends) {
+    for (int size : sizes) {
+      for (int n : readers) {
+        for (int conflate : conflates) {
+          for (int rate : rates) {
+            BenchCase c = {backend, (size_t)size, n, conflate != 0, rate};
+            BenchResult res = run_case(c, duration);
+
+            double sent_s = res.sent / res.duration;
+            double recv_s = res.received / res.duration;
+            double cpu_us = res.received > 0 ? res.cpu * 1e6 / res.received : 0;
+            double p50 = percentile(res.latencies, 0.5), p99 = percentile(res.latencies, 0.99);
+            double p999 = percentile(res.latencies, 0.999), max = percentile(res.latencies, 1.0);
+
+            if (json) {
+              printf("%s  {\"backend\": \"%s\", \"size\": %zu, \"readers\": %d, \"conflate\": %s, \"rate\": %d, "
+                     "\"sent\": %" PRIu64 ", \"received\": %" PRIu64 ", \"duration\": %.3f, \"sent_per_s\": %.1f, \"received_per_s\": %.1f, "
+                     "\"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f, \"max_us\": %.2f, \"cpu_us_per_msg\": %.3f}",
+                     first ? "" : ",\n", backend.c_str(), c.size, n, conflate ? "true" : "false", rate,
+                     res.sent, res.received, res.duration, sent_s, recv_s, p50, p99, p999, max, cpu_us);
+            } else {
+              printf("%-5s %8zu %7d %8d %6d %10.0f %10.0f %9.1f %9.1f %9.1f %9.1f %11.2f\n", backend.c_str(), c.size, n,
+                     conflate, rate, sent_s, recv_s, p50, p99, p999, max, cpu_us);
+            }
+            fflush(stdout);
+            first = false;
+          }
+        }
+      }
+    }
+  }
+
+  if (json) {
+    printf("\n]\n");
+  }
+  return 0;
+}
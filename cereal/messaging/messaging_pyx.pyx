@@ -6,6 +6,7 @@ from libcpp.string cimport string
 from libcpp.vector cimport vector
 from libcpp cimport bool
 from libc cimport errno
+from libc.stdint cimport uint64_t
 from libc.string cimport strerror
 from cython.operator import dereference
 
@@ -16,6 +17,7 @@ from .messaging cimport PubSocket as cppPubSocket
 from .messaging cimport Poller as cppPoller
 from .messaging cimport Message as cppMessage
 from .messaging cimport Event as cppEvent, SocketEventHandle as cppSocketEventHandle
+from .messaging cimport trace_enabled as cpp_trace_enabled, trace_publish as cpp_trace_publish, trace_receive as cpp_trace_receive
 
 
 class MessagingError(Exception):
@@ -52,6 +54,18 @@ def wait_for_one_event(list events, int timeout=-1):
   return cppEvent.wait_for_one(items, timeout)
 
 
+def trace_enabled():
+  return cpp_trace_enabled()
+
+
+def trace_publish(int service, uint64_t log_mono_time):
+  cpp_trace_publish(service, log_mono_time)
+
+
+def trace_receive(int service, uint64_t log_mono_time):
+  cpp_trace_receive(service, log_mono_time)
+
+
 cdef class Event:
   cdef cppEvent event;
 
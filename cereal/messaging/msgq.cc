@@ -11,6 +11,7 @@
 #include <random>
 #include <string>
 #include <limits>
+#include <mutex>
 
 #include <poll.h>
 #include <sys/ioctl.h>
@@ -21,26 +22,217 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/futex.h>
+#endif
+
 #include <stdio.h>
 
 #include "cereal/messaging/msgq.h"
 
-void sigusr2_handler(int signal) {
-  assert(signal == SIGUSR2);
-}
-
 uint64_t msgq_get_uid(void){
   std::random_device rd("/dev/urandom");
   std::uniform_int_distribution<uint64_t> distribution(0, std::numeric_limits<uint32_t>::max());
 
+  uint64_t uid = distribution(rd) << 32 | getpid();
+  return uid;
+}
+
+static uint64_t msgq_get_thread_uid(void){
   #ifdef __APPLE__
-    // TODO: this doesn't work
-    uint64_t uid = distribution(rd) << 32 | getpid();
+    // TODO: this doesn't work for multithreaded programs
+    return msgq_get_uid();
   #else
-    uint64_t uid = distribution(rd) << 32 | syscall(SYS_gettid);
+    return (msgq_get_uid() & 0xFFFFFFFF00000000) | syscall(SYS_gettid);
   #endif
+}
 
-  return uid;
+// The lowest bit of a lease is always set, so it never equals MSGQ_NO_LEASE.
+// Messages are 8 byte aligned, the bit isn't part of the offset
+static uint64_t msgq_pack_lease(uint32_t cycles, uint32_t pointer){
+  uint64_t lease;
+  PACK64(lease, cycles, (pointer | 1));
+  return lease;
+}
+
+static uint64_t msgq_time_ns(void){
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+std::string msgq_shm_path(const char * path){
+  std::string full_path = "/dev/shm/";
+  const char* prefix = std::getenv("OPENPILOT_PREFIX");
+  if (prefix) {
+    full_path += std::string(prefix) + "/";
+  }
+  return full_path + path;
+}
+
+static void futex_wait(std::atomic<uint32_t> *addr, uint32_t val, int timeout_ms){
+#ifdef __linux__
+  struct timespec ts;
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (timeout_ms % 1000) * 1000 * 1000;
+  // Not FUTEX_PRIVATE_FLAG, the word is shared with other processes
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAIT, val, (timeout_ms == -1) ? NULL : &ts, NULL, 0);
+#else
+  // No futex outside of Linux (only used for development on macOS). Waiters
+  // poll in slices of at most 10 ms instead, futex_wake is a no-op there
+  UNUSED(addr);
+  UNUSED(val);
+  int ms = (timeout_ms == -1 || timeout_ms > 10) ? 10 : timeout_ms;
+  usleep(ms * 1000);
+#endif
+}
+
+static void futex_wake(std::atomic<uint32_t> *addr){
+#ifdef __linux__
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAKE, std::numeric_limits<int>::max(), NULL, NULL, 0);
+#else
+  UNUSED(addr);
+#endif
+}
+
+static msgq_doorbell_t *msgq_doorbells(void){
+  static std::once_flag init_flag;
+  static msgq_doorbell_t *doorbells = NULL;
+
+  std::call_once(init_flag, [](){
+    std::string full_path = msgq_shm_path("msgq_doorbells");
+    size_t size = NUM_DOORBELLS * sizeof(msgq_doorbell_t);
+
+    int fd = open(full_path.c_str(), O_RDWR | O_CREAT, 0664);
+    if (fd < 0) {
+      std::cout << "Warning, could not open: " << full_path << std::endl;
+      return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || ((size_t)st.st_size < size && ftruncate(fd, size) != 0)){
+      close(fd);
+      return;
+    }
+
+    void * mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (mem != MAP_FAILED){
+      doorbells = (msgq_doorbell_t *)mem;
+    }
+  });
+
+  return doorbells;
+}
+
+// Owners are identified by the pid or tid in the lower half of their uid
+static bool msgq_owner_exited(uint64_t uid){
+  #ifdef __APPLE__
+    UNUSED(uid);
+    return false;
+  #else
+    return kill(uid & 0xFFFFFFFF, 0) != 0 && errno == ESRCH;
+  #endif
+}
+
+// Each polling thread owns one doorbell for its lifetime
+struct msgq_doorbell_owner_t {
+  int id = -1;
+  uint64_t uid = 0;
+
+  ~msgq_doorbell_owner_t(){
+    msgq_doorbell_t *doorbells = msgq_doorbells();
+    if (id >= 0 && doorbells != NULL){
+      std::atomic_compare_exchange_strong(&doorbells[id].owner, &uid, (uint64_t)0);
+    }
+  }
+};
+
+static thread_local msgq_doorbell_owner_t msgq_local_doorbell;
+
+static int msgq_claim_doorbell(msgq_doorbell_t *doorbells, uint64_t uid){
+  // First look for a free slot, then reclaim slots of owners that exited without releasing theirs
+  for (int pass = 0; pass < 2; pass++){
+    for (int i = 0; i < NUM_DOORBELLS; i++){
+      uint64_t owner = doorbells[i].owner;
+      if (owner != 0 && (pass == 0 || !msgq_owner_exited(owner))){
+        continue;
+      }
+
+      if (std::atomic_compare_exchange_strong(&doorbells[i].owner, &owner, uid)){
+        doorbells[i].waiting = 0;
+        for (auto &word : doorbells[i].ready){
+          word = 0;
+        }
+        return i;
+      }
+    }
+  }
+  return -1;
+}
+
+static msgq_doorbell_t *msgq_get_doorbell(int *id){
+  msgq_doorbell_t *doorbells = msgq_doorbells();
+  if (doorbells == NULL){
+    return NULL;
+  }
+
+  if (msgq_local_doorbell.id < 0){
+    uint64_t uid = msgq_get_thread_uid();
+    msgq_local_doorbell.id = msgq_claim_doorbell(doorbells, uid);
+    if (msgq_local_doorbell.id < 0){
+      return NULL;
+    }
+    msgq_local_doorbell.uid = uid;
+  }
+
+  *id = msgq_local_doorbell.id;
+  return &doorbells[msgq_local_doorbell.id];
+}
+
+// Point our reader slot at a new doorbell. The slot might have been taken over
+// by another subscriber in the meantime, only touch it if it is still ours and
+// nobody replaced our previous doorbell
+static void msgq_set_doorbell(msgq_queue_t *q, uint64_t doorbell){
+  uint64_t prev = q->doorbell_local;
+  q->doorbell_local = doorbell;
+
+  int id = q->reader_id;
+  if (q->read_uid_local == q->readers[id].read_uid){
+    std::atomic_compare_exchange_strong(&q->readers[id].doorbell, &prev, doorbell);
+  }
+}
+
+static void msgq_ring_doorbell(uint64_t doorbell){
+  uint32_t bit, id;
+  UNPACK64(bit, id, doorbell);
+
+  // 0 means the reader never blocked in a poll
+  if (id == 0 || id > NUM_DOORBELLS){
+    return;
+  }
+
+  msgq_doorbell_t *doorbells = msgq_doorbells();
+  if (doorbells == NULL){
+    return;
+  }
+
+  msgq_doorbell_t *d = &doorbells[id - 1];
+
+  // Tell a wait set which of its queues has new data. Skip the atomic
+  // read-modify-write if the reader didn't get to the previous message yet
+  if (bit != 0 && bit <= NUM_DOORBELL_BITS){
+    std::atomic<uint64_t> *word = &d->ready[(bit - 1) / 64];
+    uint64_t mask = 1ULL << ((bit - 1) % 64);
+    if ((*word & mask) == 0){
+      word->fetch_or(mask);
+    }
+  }
+
+  // Only pay for the syscall if the reader is actually waiting
+  if (d->waiting){
+    d->seq++;
+    futex_wake(&d->seq);
+  }
 }
 
 int msgq_msg_init_size(msgq_msg_t * msg, size_t size){
@@ -71,8 +263,11 @@ int msgq_msg_close(msgq_msg_t * msg){
 
 void msgq_reset_reader(msgq_queue_t * q){
   int id = q->reader_id;
-  q->read_valids[id]->store(true);
-  q->read_pointers[id]->store(*q->write_pointer);
+  q->readers[id].read_valid.store(true);
+  q->readers[id].read_pointer.store(*q->write_pointer);
+
+  q->readers[id].resets.store(q->readers[id].resets.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  q->readers[id].read_count.store(q->write_count->load(std::memory_order_relaxed), std::memory_order_relaxed);
 }
 
 void msgq_wait_for_subscriber(msgq_queue_t *q){
@@ -83,16 +278,32 @@ void msgq_wait_for_subscriber(msgq_queue_t *q){
   return;
 }
 
+static size_t msgq_mmap_size(size_t size, size_t num_reader_slots){
+  return sizeof(msgq_header_t) + num_reader_slots * sizeof(msgq_reader_t) + size;
+}
+
+static char * msgq_mmap(int fd, size_t mmap_size){
+  // Only ever grow the file, another process might have mapped more of it already
+  struct stat st;
+  if (fstat(fd, &st) != 0){
+    return NULL;
+  }
+  if ((size_t)st.st_size < mmap_size && ftruncate(fd, mmap_size) != 0){
+    return NULL;
+  }
+
+  char * mem = (char*)mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  return (mem == MAP_FAILED) ? NULL : mem;
+}
+
 int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
   assert(size < 0xFFFFFFFF); // Buffer must be smaller than 2^32 bytes
-  std::signal(SIGUSR2, sigusr2_handler);
 
-  std::string full_path = "/dev/shm/";
-  const char* prefix = std::getenv("OPENPILOT_PREFIX");
-  if (prefix) {
-    full_path += std::string(prefix) + "/";
-  }
-  full_path += path;
+  // msgq_close_queue must be safe to call if we fail below
+  q->mmap_p = NULL;
+  q->reader_id = -1;
+
+  std::string full_path = msgq_shm_path(path);
 
   auto fd = open(full_path.c_str(), O_RDWR | O_CREAT, 0664);
   if (fd < 0) {
@@ -100,35 +311,74 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
     return -1;
   }
 
-  int rc = ftruncate(fd, size + sizeof(msgq_header_t));
-  if (rc < 0){
-    close(fd);
-    return -1;
+  // Reader capacity if we are the first to set up this queue
+  size_t num_reader_slots = NUM_READERS;
+  const char* num_readers_env = std::getenv("MSGQ_NUM_READERS");
+  if (num_readers_env) {
+    num_reader_slots = std::clamp(std::atoi(num_readers_env), 1, MAX_NUM_READERS);
   }
-  char * mem = (char*)mmap(NULL, size + sizeof(msgq_header_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  close(fd);
 
+  size_t mmap_size = msgq_mmap_size(size, num_reader_slots);
+  char * mem = msgq_mmap(fd, mmap_size);
   if (mem == NULL){
+    close(fd);
     return -1;
   }
-  q->mmap_p = mem;
 
   msgq_header_t *header = (msgq_header_t *)mem;
 
-  // Setup pointers to header segment
-  q->num_readers = reinterpret_cast<std::atomic<uint64_t>*>(&header->num_readers);
-  q->write_pointer = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_pointer);
-  q->write_uid = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_uid);
+  // A new queue file is all zeros, which is the clean state of the header and
+  // every reader slot. Only publish the layout, writing anything else here would
+  // race with whoever attaches to the queue at the same time
+  uint64_t layout = header->layout;
+  if (layout == 0){
+    uint64_t new_layout = ((uint64_t)MSGQ_VERSION << 32) | num_reader_slots;
+    if (std::atomic_compare_exchange_strong(&header->layout, &layout, new_layout)){
+      layout = new_layout;
+    }
+  }
 
-  for (size_t i = 0; i < NUM_READERS; i++){
-    q->read_pointers[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_pointers[i]);
-    q->read_valids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_valids[i]);
-    q->read_uids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_uids[i]);
+  if ((layout >> 32) != MSGQ_VERSION){
+    std::cout << "Warning, " << full_path << " has an incompatible msgq layout, refusing to attach" << std::endl;
+    munmap(mem, mmap_size);
+    close(fd);
+    errno = EPROTO;
+    return -1;
   }
 
-  q->data = mem + sizeof(msgq_header_t);
+  // Queue was set up by someone else with a different reader capacity
+  if ((layout & 0xFFFFFFFF) != num_reader_slots){
+    munmap(mem, mmap_size);
+    num_reader_slots = layout & 0xFFFFFFFF;
+    mmap_size = msgq_mmap_size(size, num_reader_slots);
+    mem = msgq_mmap(fd, mmap_size);
+    if (mem == NULL){
+      close(fd);
+      return -1;
+    }
+    header = (msgq_header_t *)mem;
+  }
+  close(fd);
+
+  q->mmap_p = mem;
+  q->mmap_size = mmap_size;
+
+  // Setup pointers to header segment
+  q->num_readers = &header->num_readers;
+  q->write_pointer = &header->write_pointer;
+  q->write_uid = &header->write_uid;
+  q->write_count = &header->write_count;
+  q->write_bytes = &header->write_bytes;
+  q->readers = (msgq_reader_t *)(mem + sizeof(msgq_header_t));
+  q->num_reader_slots = num_reader_slots;
+
+  q->data = mem + sizeof(msgq_header_t) + num_reader_slots * sizeof(msgq_reader_t);
   q->size = size;
   q->reader_id = -1;
+  q->doorbell_local = 0;
+  q->waitset_owner = 0;
+  q->lease_local = MSGQ_NO_LEASE;
+  q->reserved_size = 0;
 
   q->endpoint = path;
   q->read_conflate = false;
@@ -137,9 +387,23 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
 }
 
 void msgq_close_queue(msgq_queue_t *q){
-  if (q->mmap_p != NULL){
-    munmap(q->mmap_p, q->size + sizeof(msgq_header_t));
+  if (q->mmap_p == NULL){
+    return;
+  }
+
+  // Give our reader slot back
+  int id = q->reader_id;
+  if (id >= 0){
+    uint64_t uid = q->read_uid_local;
+    if (std::atomic_compare_exchange_strong(&q->readers[id].read_uid, &uid, (uint64_t)0)){
+      q->readers[id].read_valid = false;
+      q->readers[id].doorbell = 0;
+      q->readers[id].lease = MSGQ_NO_LEASE;
+    }
   }
+
+  munmap(q->mmap_p, q->mmap_size);
+  q->mmap_p = NULL;
 }
 
 
@@ -150,21 +414,36 @@ void msgq_init_publisher(msgq_queue_t * q) {
   *q->write_uid = uid;
   *q->num_readers = 0;
 
-  for (size_t i = 0; i < NUM_READERS; i++){
-    *q->read_valids[i] = false;
-    *q->read_uids[i] = 0;
+  for (size_t i = 0; i < q->num_reader_slots; i++){
+    q->readers[i].read_valid = false;
+    q->readers[i].read_uid = 0;
+
+    // Wake up reader in case they are in a poll, so they reconnect
+    msgq_ring_doorbell(q->readers[i].doorbell);
+    q->readers[i].doorbell = 0;
+    q->readers[i].lease = MSGQ_NO_LEASE;
   }
 
   q->write_uid_local = uid;
 }
 
-static void thread_signal(uint32_t tid) {
-  #ifndef SYS_tkill
-    // TODO: this won't work for multithreaded programs
-    kill(tid, SIGUSR2);
-  #else
-    syscall(SYS_tkill, tid, SIGUSR2);
-  #endif
+static int msgq_claim_reader(msgq_queue_t * q, uint64_t uid){
+  // First look for a free slot, then take over slots of readers that died without closing
+  for (int pass = 0; pass < 2; pass++){
+    for (size_t i = 0; i < q->num_reader_slots; i++){
+      uint64_t cur_uid = q->readers[i].read_uid;
+      if (cur_uid != 0 && (pass == 0 || !msgq_owner_exited(cur_uid))){
+        continue;
+      }
+
+      // Use atomic compare and swap to handle race condition
+      // where two subscribers start at the same time
+      if (std::atomic_compare_exchange_strong(&q->readers[i].read_uid, &cur_uid, uid)){
+        return i;
+      }
+    }
+  }
+  return -1;
 }
 
 void msgq_init_subscriber(msgq_queue_t * q) {
@@ -172,60 +451,67 @@ void msgq_init_subscriber(msgq_queue_t * q) {
   assert(q->num_readers != NULL);
 
   uint64_t uid = msgq_get_uid();
+  int prev_id = q->reader_id;
 
   // Get reader id
-  while (true){
-    uint64_t cur_num_readers = *q->num_readers;
-    uint64_t new_num_readers = cur_num_readers + 1;
-
-    // No more slots available. Reset all subscribers to kick out inactive ones
-    if (new_num_readers > NUM_READERS){
-      //std::cout << "Warning, evicting all subscribers!" << std::endl;
-      *q->num_readers = 0;
-
-      for (size_t i = 0; i < NUM_READERS; i++){
-        *q->read_valids[i] = false;
-
-        uint64_t old_uid = *q->read_uids[i];
-        *q->read_uids[i] = 0;
-
-        // Wake up reader in case they are in a poll
-        thread_signal(old_uid & 0xFFFFFFFF);
+  int id = msgq_claim_reader(q, uid);
+  while (id < 0){
+    // All readers are alive. Evict the one furthest behind, it is the most likely to be stuck
+    size_t slowest = 0;
+    for (size_t i = 1; i < q->num_reader_slots; i++){
+      if (q->readers[i].read_pointer < q->readers[slowest].read_pointer){
+        slowest = i;
       }
+    }
+    std::cout << "Warning, all reader slots of " << q->endpoint << " in use, evicting reader " << slowest << std::endl;
 
-      continue;
+    uint64_t cur_uid = q->readers[slowest].read_uid;
+    if (std::atomic_compare_exchange_strong(&q->readers[slowest].read_uid, &cur_uid, uid)){
+      // Wake up reader in case they are in a poll
+      msgq_ring_doorbell(q->readers[slowest].doorbell);
+      id = slowest;
     }
+  }
 
-    // Use atomic compare and swap to handle race condition
-    // where two subscribers start at the same time
-    if (std::atomic_compare_exchange_strong(q->num_readers,
-                                            &cur_num_readers,
-                                            new_num_readers)){
-      q->reader_id = cur_num_readers;
-      q->read_uid_local = uid;
+  q->reader_id = id;
+  q->read_uid_local = uid;
+  q->lease_local = MSGQ_NO_LEASE;
 
-      // We start with read_valid = false,
-      // on the first read the read pointer will be synchronized with the write pointer
-      *q->read_valids[cur_num_readers] = false;
-      *q->read_pointers[cur_num_readers] = 0;
-      *q->read_uids[cur_num_readers] = uid;
-      break;
-    }
+  // We start with read_valid = false,
+  // on the first read the read pointer will be synchronized with the write pointer
+  q->readers[id].read_valid = false;
+  q->readers[id].read_pointer = 0;
+  q->readers[id].doorbell = q->doorbell_local;
+  q->readers[id].lease = MSGQ_NO_LEASE;
+
+  // Make sure the writer looks at our slot
+  uint64_t num_readers = *q->num_readers;
+  while (num_readers < (uint64_t)id + 1 && !std::atomic_compare_exchange_weak(q->num_readers, &num_readers, (uint64_t)id + 1)){
   }
 
   //std::cout << "New subscriber id: " << q->reader_id << " uid: " << q->read_uid_local << " " << q->endpoint << std::endl;
   msgq_reset_reader(q);
+
+  // Syncing up with the writer on connect is not a reset. Getting our old
+  // slot back after the publisher restarted keeps its telemetry, and the
+  // messages skipped while reconnecting count as a reset
+  if (id != prev_id){
+    q->readers[id].resets = 0;
+    q->readers[id].read_time = 0;
+  }
 }
 
-int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
+// Claim space for a message of the given size. The caller writes the message
+// into the returned buffer and publishes it with msgq_msg_commit
+char * msgq_msg_reserve(msgq_queue_t *q, size_t size){
   // Die if we are no longer the active publisher
   if (q->write_uid_local != *q->write_uid){
     std::cout << "Killing old publisher: " << q->endpoint << std::endl;
     errno = EADDRINUSE;
-    return -1;
+    return NULL;
   }
 
-  uint64_t total_msg_size = ALIGN(msg->size + sizeof(int64_t));
+  uint64_t total_msg_size = ALIGN(size + sizeof(int64_t));
 
   // We need to fit at least three messages in the queue,
   // then we can always safely access the last message
@@ -248,12 +534,21 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
     // Invalidate all readers that are beyond the write pointer
     // TODO: should we handle the case where a new reader shows up while this is running?
     for (uint64_t i = 0; i < num_readers; i++){
-      uint64_t read_pointer = *q->read_pointers[i];
+      uint64_t read_pointer = q->readers[i].read_pointer;
       uint64_t read_cycles = read_pointer >> 32;
       read_pointer &= 0xFFFFFFFF;
 
       if ((read_pointer > write_pointer) && (read_cycles != write_cycles)) {
-        *q->read_valids[i] = false;
+        q->readers[i].read_valid = false;
+      }
+
+      // Same for messages a reader is holding a lease on
+      uint64_t lease = q->readers[i].lease;
+      uint64_t lease_cycles = lease >> 32;
+      uint64_t lease_pointer = lease & 0xFFFFFFFE;
+
+      if ((lease != MSGQ_NO_LEASE) && (lease_pointer > write_pointer) && (lease_cycles != write_cycles)) {
+        q->readers[i].lease = MSGQ_NO_LEASE;
       }
     }
 
@@ -268,37 +563,73 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
 
   // Invalidate readers that are in the area that will be written
   uint64_t start = write_pointer;
-  uint64_t end = ALIGN(start + sizeof(int64_t) + msg->size);
+  uint64_t end = ALIGN(start + sizeof(int64_t) + size);
 
   for (uint64_t i = 0; i < num_readers; i++){
     uint32_t read_cycles, read_pointer;
-    UNPACK64(read_cycles, read_pointer, *q->read_pointers[i]);
+    UNPACK64(read_cycles, read_pointer, q->readers[i].read_pointer);
 
     if ((read_pointer >= start) && (read_pointer < end) && (read_cycles != write_cycles)) {
-      *q->read_valids[i] = false;
+      q->readers[i].read_valid = false;
+    }
+
+    uint64_t lease = q->readers[i].lease;
+    uint32_t lease_cycles, lease_pointer;
+    UNPACK64(lease_cycles, lease_pointer, lease);
+    lease_pointer &= ~1U;
+
+    if ((lease != MSGQ_NO_LEASE) && (lease_pointer >= start) && (lease_pointer < end) && (lease_cycles != write_cycles)) {
+      q->readers[i].lease = MSGQ_NO_LEASE;
     }
   }
 
 
+  q->reserved_size = size;
+  return p + sizeof(int64_t);
+}
+
+// Publish the message written into the last reserved buffer.
+// size may be smaller than what was reserved
+int msgq_msg_commit(msgq_queue_t *q, size_t size){
+  assert(size <= q->reserved_size);
+  q->reserved_size = 0;
+
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+
+  char *p = q->data + write_pointer;
+
   // Write size tag
   std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(p);
-  *size_p = msg->size;
-
-  // Copy data
-  memcpy(p + sizeof(int64_t), msg->data, msg->size);
+  *size_p = size;
   __sync_synchronize();
 
   // Update write pointer
-  uint32_t new_ptr = ALIGN(write_pointer + msg->size + sizeof(int64_t));
+  uint32_t new_ptr = ALIGN(write_pointer + size + sizeof(int64_t));
   PACK64(*q->write_pointer, write_cycles, new_ptr);
 
-  // Notify readers
+  q->write_count->store(q->write_count->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  q->write_bytes->store(q->write_bytes->load(std::memory_order_relaxed) + size, std::memory_order_relaxed);
+
+  // Notify readers that are blocked in a poll
+  uint64_t num_readers = *q->num_readers;
   for (uint64_t i = 0; i < num_readers; i++){
-    uint64_t reader_uid = *q->read_uids[i];
-    thread_signal(reader_uid & 0xFFFFFFFF);
+    msgq_ring_doorbell(q->readers[i].doorbell);
   }
 
-  return msg->size;
+  return size;
+}
+
+int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
+  char *p = msgq_msg_reserve(q, msg->size);
+  if (p == NULL){
+    return -1;
+  }
+
+  // Copy data
+  memcpy(p, msg->data, msg->size);
+
+  return msgq_msg_commit(q, msg->size);
 }
 
 
@@ -307,20 +638,20 @@ int msgq_msg_ready(msgq_queue_t * q){
   int id = q->reader_id;
   assert(id >= 0); // Make sure subscriber is initialized
 
-  if (q->read_uid_local != *q->read_uids[id]){
+  if (q->read_uid_local != q->readers[id].read_uid){
     //std::cout << q->endpoint << ": Reader was evicted, reconnecting" << std::endl;
     msgq_init_subscriber(q);
     goto start;
   }
 
   // Check valid
-  if (!*q->read_valids[id]){
+  if (!q->readers[id].read_valid){
     msgq_reset_reader(q);
     goto start;
   }
 
   uint32_t read_cycles, read_pointer;
-  UNPACK64(read_cycles, read_pointer, *q->read_pointers[id]);
+  UNPACK64(read_cycles, read_pointer, q->readers[id].read_pointer);
   UNUSED(read_cycles);
 
   uint32_t write_cycles, write_pointer;
@@ -331,25 +662,31 @@ int msgq_msg_ready(msgq_queue_t * q){
   return (read_pointer != write_pointer);
 }
 
-int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
+static void msgq_count_read(msgq_queue_t * q, uint64_t count = 1){
+  msgq_reader_t *reader = &q->readers[q->reader_id];
+  reader->read_count.store(reader->read_count.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+  reader->read_time.store(msgq_time_ns(), std::memory_order_relaxed);
+}
+
+static int msgq_msg_recv_internal(msgq_msg_t * msg, msgq_queue_t * q, bool lease){
  start:
   int id = q->reader_id;
   assert(id >= 0); // Make sure subscriber is initialized
 
-  if (q->read_uid_local != *q->read_uids[id]){
+  if (q->read_uid_local != q->readers[id].read_uid){
     //std::cout << q->endpoint << ": Reader was evicted, reconnecting" << std::endl;
     msgq_init_subscriber(q);
     goto start;
   }
 
   // Check valid
-  if (!*q->read_valids[id]){
+  if (!q->readers[id].read_valid){
     msgq_reset_reader(q);
     goto start;
   }
 
   uint32_t read_cycles, read_pointer;
-  UNPACK64(read_cycles, read_pointer, *q->read_pointers[id]);
+  UNPACK64(read_cycles, read_pointer, q->readers[id].read_pointer);
 
   uint32_t write_cycles, write_pointer;
   UNPACK64(write_cycles, write_pointer, *q->write_pointer);
@@ -368,7 +705,7 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
   std::int64_t size = *size_p;
 
   // Check if the size that was read is valid
-  if (!*q->read_valids[id]){
+  if (!q->readers[id].read_valid){
     msgq_reset_reader(q);
     goto start;
   }
@@ -376,7 +713,7 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
   // If size is -1 the buffer was full, and we need to wrap around
   if (size == -1){
     read_cycles++;
-    PACK64(*q->read_pointers[id], read_cycles, 0);
+    PACK64(q->readers[id].read_pointer, read_cycles, 0);
     goto start;
   }
 
@@ -391,11 +728,33 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
   if (q->read_conflate){
     if (new_read_pointer != write_pointer){
       // Update read pointer
-      PACK64(*q->read_pointers[id], read_cycles, new_read_pointer);
+      PACK64(q->readers[id].read_pointer, read_cycles, new_read_pointer);
+      msgq_count_read(q);
       goto start;
     }
   }
 
+  if (lease){
+    // Protect the message before moving the read pointer past it, the writer
+    // drops the lease instead of overwriting the data underneath us
+    q->lease_local = msgq_pack_lease(read_cycles, read_pointer);
+    q->readers[id].lease = q->lease_local;
+
+    // Check if the size that was read is still valid
+    if (!q->readers[id].read_valid){
+      msgq_lease_release(q);
+      msgq_reset_reader(q);
+      goto start;
+    }
+
+    PACK64(q->readers[id].read_pointer, read_cycles, new_read_pointer);
+    msgq_count_read(q);
+
+    msg->size = size;
+    msg->data = p + sizeof(int64_t);
+    return msg->size;
+  }
+
   // Copy message
   if (msgq_msg_init_size(msg, size) < 0)
     return -1;
@@ -405,19 +764,124 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
   __sync_synchronize();
 
   // Update read pointer
-  PACK64(*q->read_pointers[id], read_cycles, new_read_pointer);
+  PACK64(q->readers[id].read_pointer, read_cycles, new_read_pointer);
 
   // Check if the actual data that was copied is valid
-  if (!*q->read_valids[id]){
+  if (!q->readers[id].read_valid){
     msgq_msg_close(msg);
     msgq_reset_reader(q);
     goto start;
   }
 
-
+  msgq_count_read(q);
   return msg->size;
 }
 
+int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
+  return msgq_msg_recv_internal(msg, q, false);
+}
+
+// Receive without copying. msg->data points into the queue and stays there
+// until the next lease or msgq_lease_release. Check msgq_lease_valid after
+// using the data to know if the writer overwrote it in the meantime.
+int msgq_msg_recv_lease(msgq_msg_t * msg, msgq_queue_t * q){
+  return msgq_msg_recv_internal(msg, q, true);
+}
+
+// Lease every message up to the current write pointer, at most max_msgs, in one pass.
+// The entries of msgs point into the queue, like msgq_msg_recv_lease. Leasing the
+// first message covers the whole batch, the writer always overwrites it first.
+int msgq_msg_recv_batch(std::vector<msgq_msg_t> *msgs, size_t max_msgs, msgq_queue_t * q){
+ start:
+  msgs->clear();
+
+  int id = q->reader_id;
+  assert(id >= 0); // Make sure subscriber is initialized
+
+  if (q->read_uid_local != q->readers[id].read_uid){
+    msgq_init_subscriber(q);
+    goto start;
+  }
+
+  // Check valid
+  if (!q->readers[id].read_valid){
+    msgq_reset_reader(q);
+    goto start;
+  }
+
+  uint32_t read_cycles, read_pointer;
+  UNPACK64(read_cycles, read_pointer, q->readers[id].read_pointer);
+
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+  UNUSED(write_cycles);
+
+  if (read_pointer == write_pointer || max_msgs == 0) {
+    return 0;
+  }
+
+  q->lease_local = msgq_pack_lease(read_cycles, read_pointer);
+  q->readers[id].lease = q->lease_local;
+
+  while (read_pointer != write_pointer && msgs->size() < max_msgs){
+    char * p = q->data + read_pointer;
+    std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(p);
+    std::int64_t size = *size_p;
+
+    // If size is -1 the buffer was full, and we need to wrap around
+    if (size == -1){
+      read_cycles++;
+      read_pointer = 0;
+      continue;
+    }
+
+    // Sizes aren't checked one by one against read_valid. A bad one means
+    // we were overwritten, unless the writer says otherwise
+    if (size <= 0 || (uint64_t)(read_pointer + sizeof(int64_t) + size) > q->size){
+      assert(!q->readers[id].read_valid);
+      msgq_lease_release(q);
+      msgq_reset_reader(q);
+      goto start;
+    }
+
+    msgs->push_back({(size_t)size, p + sizeof(int64_t)});
+    read_pointer = ALIGN(read_pointer + sizeof(std::int64_t) + size);
+  }
+
+  // Check if the messages are still valid
+  if (!q->readers[id].read_valid || q->readers[id].lease != q->lease_local){
+    msgq_lease_release(q);
+    msgq_reset_reader(q);
+    goto start;
+  }
+
+  PACK64(q->readers[id].read_pointer, read_cycles, read_pointer);
+  msgq_count_read(q, msgs->size());
+
+  if (q->read_conflate && msgs->size() > 1){
+    msgs->erase(msgs->begin(), msgs->end() - 1);
+  }
+
+  return msgs->size();
+}
+
+bool msgq_lease_valid(msgq_queue_t * q){
+  int id = q->reader_id;
+  if (id < 0 || q->lease_local == MSGQ_NO_LEASE){
+    return false;
+  }
+
+  return (q->read_uid_local == q->readers[id].read_uid) && (q->readers[id].lease == q->lease_local);
+}
+
+void msgq_lease_release(msgq_queue_t * q){
+  int id = q->reader_id;
+  if (id >= 0 && q->lease_local != MSGQ_NO_LEASE){
+    std::atomic_compare_exchange_strong(&q->readers[id].lease, &q->lease_local, MSGQ_NO_LEASE);
+  }
+  q->lease_local = MSGQ_NO_LEASE;
+}
+
 
 
 int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
@@ -429,40 +893,318 @@ int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
     if (items[i].revents) num++;
   }
 
-  int ms = (timeout == -1) ? 100 : timeout;
-  struct timespec ts;
-  ts.tv_sec = ms / 1000;
-  ts.tv_nsec = (ms % 1000) * 1000 * 1000;
+  if (num > 0 || timeout == 0){
+    return num;
+  }
 
+  int doorbell_id = -1;
+  msgq_doorbell_t *d = msgq_get_doorbell(&doorbell_id);
 
-  while (num == 0) {
-    int ret;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+  // Queues of a live wait set are borrowed while we block, they ring our doorbell
+  // until we return. The queue isn't used by anyone else in the meantime, its
+  // wait set only looks at it from the thread we are running on
+  std::vector<uint64_t> borrowed;
+  if (d != NULL){
+    msgq_doorbell_t *doorbells = msgq_doorbells();
+    for (size_t i = 0; i < nitems; i++) {
+      msgq_queue_t *q = items[i].q;
+
+      if (q->waitset_owner != 0){
+        uint32_t ws_id = q->doorbell_local & 0xFFFFFFFF;
+        if (doorbells[ws_id - 1].owner == q->waitset_owner){
+          borrowed.resize(nitems, 0);
+          borrowed[i] = q->doorbell_local;
+        } else {
+          q->waitset_owner = 0;
+        }
+      }
+
+      // If we were evicted, msgq_msg_ready reconnects and registers doorbell_local with the new slot
+      if (q->doorbell_local != (uint64_t)doorbell_id + 1){
+        msgq_set_doorbell(q, doorbell_id + 1);
+      }
+    }
+  }
 
-    ret = nanosleep(&ts, &ts);
+  while (num == 0) {
+    uint32_t seq = 0;
+    if (d != NULL){
+      // Announce we are about to block before checking the queues again.
+      // A publisher either sees waiting set, or wrote before our check below
+      seq = d->seq;
+      d->waiting = 1;
+    }
 
-    // Check if messages ready
     for (size_t i = 0; i < nitems; i++) {
-      if (items[i].revents == 0 && msgq_msg_ready(items[i].q)){
+      if (msgq_msg_ready(items[i].q)){
         num += 1;
         items[i].revents = 1;
       }
     }
 
-    // exit if we had a timeout and the sleep finished
-    if (timeout != -1 && ret == 0){
+    if (num > 0){
       break;
     }
+
+    int ms = -1;
+    if (timeout != -1){
+      auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+      if (remaining.count() <= 0){
+        break;
+      }
+      ms = remaining.count();
+    }
+
+    if (d != NULL){
+      futex_wait(&d->seq, seq, ms);
+      d->waiting = 0;
+    } else {
+      // No doorbell available, fall back to sleeping in slices
+      usleep(((ms == -1 || ms > 10) ? 10 : ms) * 1000);
+    }
+  }
+
+  if (d != NULL){
+    d->waiting = 0;
+  }
+
+  // Hand borrowed queues back. Their wait set missed what arrived in the
+  // meantime, so mark them ready for it to check on its next wait
+  for (size_t i = 0; i < borrowed.size(); i++){
+    if (borrowed[i] != 0){
+      msgq_set_doorbell(items[i].q, borrowed[i]);
+      msgq_ring_doorbell(borrowed[i]);
+    }
   }
 
   return num;
 }
 
+int msgq_waitset_init(msgq_waitset_t *ws){
+  ws->owner = msgq_get_uid();
+  ws->doorbell_id = -1;
+  ws->queues.clear();
+  ws->pending.clear();
+  ws->checked.clear();
+
+  // A wait set has its own doorbell, so the ready bits only ever refer to its queues
+  msgq_doorbell_t *doorbells = msgq_doorbells();
+  if (doorbells != NULL){
+    ws->doorbell_id = msgq_claim_doorbell(doorbells, ws->owner);
+  }
+
+  return (ws->doorbell_id < 0) ? -1 : 0;
+}
+
+int msgq_waitset_add(msgq_waitset_t *ws, msgq_queue_t *q){
+  assert(q->reader_id >= 0); // Make sure subscriber is initialized
+
+  size_t idx = ws->queues.size();
+  if (idx >= NUM_DOORBELL_BITS){
+    return -1;
+  }
+
+  ws->queues.push_back(q);
+  ws->checked.push_back(false);
+
+  // Check it on the next wait, it might already have data
+  ws->pending.push_back(idx);
+
+  if (ws->doorbell_id >= 0){
+    uint32_t bit = idx + 1, id = ws->doorbell_id + 1;
+    uint64_t doorbell;
+    PACK64(doorbell, bit, id);
+    q->waitset_owner = ws->owner;
+    msgq_set_doorbell(q, doorbell);
+  }
+
+  return idx;
+}
+
+// Wait until at least one queue of the set has a message. Only the queues
+// whose bit was set by their publisher, and the ones that were ready the
+// previous time are checked, the indices of the ready ones are put in ready.
+int msgq_waitset_wait(msgq_waitset_t *ws, std::vector<size_t> *ready, int timeout){
+  ready->clear();
+
+  msgq_doorbell_t *doorbells = msgq_doorbells();
+  msgq_doorbell_t *d = (doorbells != NULL && ws->doorbell_id >= 0) ? &doorbells[ws->doorbell_id] : NULL;
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+  std::vector<size_t> candidates;
+  while (true) {
+    uint32_t seq = 0;
+    candidates.swap(ws->pending);
+    ws->pending.clear();
+
+    if (d != NULL){
+      // Announce we are about to block before collecting the ready bits.
+      // A publisher either sees waiting set, or its bit is collected below
+      seq = d->seq;
+      d->waiting = 1;
+
+      for (size_t w = 0; w < NUM_DOORBELL_BITS / 64; w++){
+        uint64_t bits = (d->ready[w] != 0) ? d->ready[w].exchange(0) : 0;
+        while (bits){
+          size_t idx = w * 64 + __builtin_ctzll(bits);
+          bits &= bits - 1;
+          if (idx < ws->queues.size()){
+            candidates.push_back(idx);
+          }
+        }
+      }
+    } else {
+      // No doorbell available, fall back to checking everything
+      for (size_t i = 0; i < ws->queues.size(); i++){
+        candidates.push_back(i);
+      }
+    }
+
+    for (size_t idx : candidates){
+      if (ws->checked[idx]){
+        continue;
+      }
+      ws->checked[idx] = true;
+
+      if (msgq_msg_ready(ws->queues[idx])){
+        ready->push_back(idx);
+      }
+    }
+    for (size_t idx : candidates){
+      ws->checked[idx] = false;
+    }
+    candidates.clear();
+
+    if (!ready->empty() || timeout == 0){
+      break;
+    }
+
+    int ms = -1;
+    if (timeout != -1){
+      auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+      if (remaining.count() <= 0){
+        break;
+      }
+      ms = remaining.count();
+    }
+
+    if (d != NULL){
+      futex_wait(&d->seq, seq, ms);
+      d->waiting = 0;
+    } else {
+      usleep(((ms == -1 || ms > 10) ? 10 : ms) * 1000);
+    }
+  }
+
+  if (d != NULL){
+    d->waiting = 0;
+  }
+
+  // Ready queues are checked again next time, the caller might not drain them
+  std::sort(ready->begin(), ready->end());
+  ws->pending = *ready;
+
+  return ready->size();
+}
+
+void msgq_waitset_close(msgq_waitset_t *ws){
+  msgq_doorbell_t *doorbells = msgq_doorbells();
+  if (ws->doorbell_id >= 0 && doorbells != NULL){
+    // Queues still pointing at the doorbell notice the owner changed and re-register in msgq_poll
+    std::atomic_compare_exchange_strong(&doorbells[ws->doorbell_id].owner, &ws->owner, (uint64_t)0);
+  }
+  ws->doorbell_id = -1;
+  ws->queues.clear();
+  ws->pending.clear();
+  ws->checked.clear();
+}
+
 bool msgq_all_readers_updated(msgq_queue_t *q) {
   uint64_t num_readers = *q->num_readers;
+  bool any_reader = false;
   for (uint64_t i = 0; i < num_readers; i++) {
-    if (*q->read_valids[i] && *q->write_pointer != *q->read_pointers[i]) {
+    if (q->readers[i].read_uid == 0) {
+      continue;
+    }
+    any_reader = true;
+
+    if (q->readers[i].read_valid && *q->write_pointer != q->readers[i].read_pointer) {
       return false;
     }
   }
-  return num_readers > 0;
+  return any_reader;
+}
+
+// Snapshot of the telemetry of a queue. Only maps the queue read-only,
+// so it is safe to call on queues owned by other processes.
+int msgq_get_stats(const char * path, msgq_stats_t *stats){
+  std::string full_path = msgq_shm_path(path);
+
+  int fd = open(full_path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(msgq_header_t)){
+    close(fd);
+    return -1;
+  }
+
+  char * mem = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED){
+    return -1;
+  }
+
+  msgq_header_t *header = (msgq_header_t *)mem;
+  uint64_t layout = header->layout;
+  size_t num_reader_slots = layout & 0xFFFFFFFF;
+  size_t header_size = msgq_mmap_size(0, num_reader_slots);
+  if ((layout >> 32) != MSGQ_VERSION || (size_t)st.st_size <= header_size){
+    munmap(mem, st.st_size);
+    errno = EPROTO;
+    return -1;
+  }
+
+  stats->size = st.st_size - header_size;
+  stats->write_count = header->write_count;
+  stats->write_bytes = header->write_bytes;
+  stats->readers.clear();
+
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, header->write_pointer);
+
+  msgq_reader_t *readers = (msgq_reader_t *)(mem + sizeof(msgq_header_t));
+  uint64_t num_readers = std::min((uint64_t)num_reader_slots, (uint64_t)header->num_readers);
+  for (uint64_t i = 0; i < num_readers; i++){
+    msgq_reader_stats_t r = {};
+    r.uid = readers[i].read_uid;
+    if (r.uid == 0){
+      continue;
+    }
+
+    uint32_t read_cycles, read_pointer;
+    UNPACK64(read_cycles, read_pointer, readers[i].read_pointer);
+
+    r.valid = readers[i].read_valid;
+    r.resets = readers[i].resets;
+    r.read_time = readers[i].read_time;
+
+    uint64_t read_count = readers[i].read_count;
+    r.lag_msgs = (stats->write_count > read_count) ? stats->write_count - read_count : 0;
+    if (read_cycles == write_cycles){
+      r.lag_bytes = (write_pointer > read_pointer) ? write_pointer - read_pointer : 0;
+    } else if (read_pointer < stats->size){
+      r.lag_bytes = stats->size - read_pointer + write_pointer;
+    }
+
+    stats->readers.push_back(r);
+  }
+
+  munmap(mem, st.st_size);
+  return 0;
 }
@@ -4,37 +4,79 @@
 #include <cstring>
 #include <string>
 #include <atomic>
+#include <vector>
 
 #define DEFAULT_SEGMENT_SIZE (10 * 1024 * 1024)
-#define NUM_READERS 12
+#define NUM_READERS 16 // reader slots of a new queue, override with MSGQ_NUM_READERS
+#define MAX_NUM_READERS 256
+#define NUM_DOORBELLS 1024
+#define NUM_DOORBELL_BITS 256 // queues per wait set
+#define MSGQ_NO_LEASE ((uint64_t)0) // zero, so a fresh reader slot holds no lease
+#define MSGQ_VERSION 0x4d510003 // "MQ" + layout version
+#define MSGQ_CACHE_LINE 64
 #define ALIGN(n) ((n + (8 - 1)) & -8)
 
 #define UNUSED(x) (void)x
 #define UNPACK64(higher, lower, input) do {uint64_t tmp = input; higher = tmp >> 32; lower = tmp & 0xFFFFFFFF;} while (0)
 #define PACK64(output, higher, lower) output = ((uint64_t)higher << 32) | ((uint64_t)lower & 0xFFFFFFFF)
 
-struct  msgq_header_t {
-  uint64_t num_readers;
-  uint64_t write_pointer;
-  uint64_t write_uid;
-  uint64_t read_pointers[NUM_READERS];
-  uint64_t read_valids[NUM_READERS];
-  uint64_t read_uids[NUM_READERS];
+// Shared memory layout: header, num_reader_slots reader slots, data segment
+struct alignas(MSGQ_CACHE_LINE) msgq_header_t {
+  std::atomic<uint64_t> layout; // MSGQ_VERSION << 32 | num_reader_slots
+  std::atomic<uint64_t> num_readers; // highest reader slot in use + 1
+  std::atomic<uint64_t> write_pointer;
+  std::atomic<uint64_t> write_uid;
+
+  // Telemetry, only ever written by the publisher
+  std::atomic<uint64_t> write_count;
+  std::atomic<uint64_t> write_bytes;
+};
+
+// Each reader gets its own cache line, so updating a read pointer
+// doesn't false share with the writer or the other readers
+struct alignas(MSGQ_CACHE_LINE) msgq_reader_t {
+  std::atomic<uint64_t> read_pointer;
+  std::atomic<uint64_t> read_valid;
+  std::atomic<uint64_t> read_uid; // 0 if the slot is free
+  std::atomic<uint64_t> doorbell;
+  std::atomic<uint64_t> lease; // read_pointer of the leased message | 1, MSGQ_NO_LEASE if none
+
+  // Telemetry, only ever written by the reader owning the slot
+  std::atomic<uint64_t> resets; // times the writer lapped this reader
+  std::atomic<uint64_t> read_count; // write_count up to which messages were consumed
+  std::atomic<uint64_t> read_time; // steady clock ns of the last received message
+};
+static_assert(sizeof(msgq_reader_t) == MSGQ_CACHE_LINE);
+
+// Futex word a polling thread blocks on. Lives in a table shared by all queues,
+// so a thread waiting on many queues only needs a single wakeup address.
+// Publishers also mark which queue of a wait set has new data in the ready bitmap.
+struct alignas(MSGQ_CACHE_LINE) msgq_doorbell_t {
+  std::atomic<uint32_t> seq;
+  std::atomic<uint32_t> waiting;
+  std::atomic<uint64_t> owner;
+  std::atomic<uint64_t> ready[NUM_DOORBELL_BITS / 64];
 };
 
 struct msgq_queue_t {
   std::atomic<uint64_t> *num_readers;
   std::atomic<uint64_t> *write_pointer;
   std::atomic<uint64_t> *write_uid;
-  std::atomic<uint64_t> *read_pointers[NUM_READERS];
-  std::atomic<uint64_t> *read_valids[NUM_READERS];
-  std::atomic<uint64_t> *read_uids[NUM_READERS];
+  std::atomic<uint64_t> *write_count;
+  std::atomic<uint64_t> *write_bytes;
+  msgq_reader_t *readers;
+  size_t num_reader_slots;
   char * mmap_p;
+  size_t mmap_size;
   char * data;
   size_t size;
   int reader_id;
   uint64_t read_uid_local;
   uint64_t write_uid_local;
+  uint64_t doorbell_local; // (ready bit + 1) << 32 | (doorbell + 1), 0 if not registered
+  uint64_t waitset_owner; // owner of the wait set doorbell the queue is registered with
+  uint64_t lease_local;
+  size_t reserved_size;
 
   bool read_conflate;
   std::string endpoint;
@@ -45,11 +87,37 @@ struct msgq_msg_t {
   char * data;
 };
 
+struct msgq_reader_stats_t {
+  uint64_t uid;
+  bool valid;
+  uint64_t resets;
+  uint64_t lag_msgs;
+  uint64_t lag_bytes;
+  uint64_t read_time;
+};
+
+struct msgq_stats_t {
+  size_t size;
+  uint64_t write_count;
+  uint64_t write_bytes;
+  std::vector<msgq_reader_stats_t> readers;
+};
+
 struct msgq_pollitem_t {
   msgq_queue_t *q;
   int revents;
 };
 
+// Persistent set of queues to wait on. Unlike msgq_poll, waiting only
+// looks at the queues that were signaled or were ready the last time.
+struct msgq_waitset_t {
+  int doorbell_id;
+  uint64_t owner;
+  std::vector<msgq_queue_t *> queues;
+  std::vector<size_t> pending;
+  std::vector<bool> checked;
+};
+
 void msgq_wait_for_subscriber(msgq_queue_t *q);
 void msgq_reset_reader(msgq_queue_t *q);
 
@@ -57,14 +125,29 @@ int msgq_msg_init_size(msgq_msg_t *msg, size_t size);
 int msgq_msg_init_data(msgq_msg_t *msg, char * data, size_t size);
 int msgq_msg_close(msgq_msg_t *msg);
 
+// Path of a shared memory file, inside OPENPILOT_PREFIX if set
+std::string msgq_shm_path(const char * path);
+
 int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size);
 void msgq_close_queue(msgq_queue_t *q);
 void msgq_init_publisher(msgq_queue_t * q);
 void msgq_init_subscriber(msgq_queue_t * q);
 
 int msgq_msg_send(msgq_msg_t *msg, msgq_queue_t *q);
+char * msgq_msg_reserve(msgq_queue_t *q, size_t size);
+int msgq_msg_commit(msgq_queue_t *q, size_t size);
 int msgq_msg_recv(msgq_msg_t *msg, msgq_queue_t *q);
+int msgq_msg_recv_lease(msgq_msg_t *msg, msgq_queue_t *q);
+int msgq_msg_recv_batch(std::vector<msgq_msg_t> *msgs, size_t max_msgs, msgq_queue_t *q);
+bool msgq_lease_valid(msgq_queue_t *q);
+void msgq_lease_release(msgq_queue_t *q);
 int msgq_msg_ready(msgq_queue_t * q);
 int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout);
 
+int msgq_waitset_init(msgq_waitset_t *ws);
+int msgq_waitset_add(msgq_waitset_t *ws, msgq_queue_t *q);
+int msgq_waitset_wait(msgq_waitset_t *ws, std::vector<size_t> *ready, int timeout);
+void msgq_waitset_close(msgq_waitset_t *ws);
+
 bool msgq_all_readers_updated(msgq_queue_t *q);
+int msgq_get_stats(const char * path, msgq_stats_t *stats);
@@ -0,0 +1,406 @@
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "catch2/catch.hpp"
+#include "cereal/messaging/msgq.h"
+
+#define TEST_QUEUE_SIZE 1024
+
+static void remove_queue(const char *path){
+  remove(msgq_shm_path(path).c_str());
+}
+
+static int send_message(msgq_queue_t *q, char c, size_t size){
+  std::vector<char> data(size, c);
+  msgq_msg_t msg = {size, data.data()};
+  return msgq_msg_send(&msg, q);
+}
+
+TEST_CASE("ALIGN"){
+  REQUIRE(ALIGN(0) == 0);
+  REQUIRE(ALIGN(1) == 8);
+  REQUIRE(ALIGN(7) == 8);
+  REQUIRE(ALIGN(8) == 8);
+  REQUIRE(ALIGN(99999) == 100000);
+}
+
+TEST_CASE("msgq_msg_reserve and msgq_msg_commit"){
+  remove_queue("test_queue");
+  msgq_queue_t writer, reader;
+  REQUIRE(msgq_new_queue(&writer, "test_queue", TEST_QUEUE_SIZE) == 0);
+  REQUIRE(msgq_new_queue(&reader, "test_queue", TEST_QUEUE_SIZE) == 0);
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  char *p = msgq_msg_reserve(&writer, 100);
+  REQUIRE(p != NULL);
+  memset(p, 'a', 100);
+
+  SECTION("Not visible before commit"){
+    REQUIRE(msgq_msg_ready(&reader) == 0);
+    REQUIRE(msgq_msg_commit(&writer, 100) == 100);
+    REQUIRE(msgq_msg_ready(&reader) == 1);
+  }
+
+  SECTION("Commit less than reserved"){
+    REQUIRE(msgq_msg_commit(&writer, 10) == 10);
+
+    msgq_msg_t msg;
+    REQUIRE(msgq_msg_recv(&msg, &reader) == 10);
+    REQUIRE(memcmp(msg.data, std::string(10, 'a').data(), 10) == 0);
+    msgq_msg_close(&msg);
+
+    // The next message starts right after the committed size
+    REQUIRE(send_message(&writer, 'b', 20) == 20);
+    REQUIRE(msgq_msg_recv(&msg, &reader) == 20);
+    REQUIRE(msg.data[0] == 'b');
+    msgq_msg_close(&msg);
+  }
+
+  SECTION("Reserve fails for a replaced publisher"){
+    REQUIRE(msgq_msg_commit(&writer, 100) == 100);
+
+    msgq_queue_t writer2;
+    REQUIRE(msgq_new_queue(&writer2, "test_queue", TEST_QUEUE_SIZE) == 0);
+    msgq_init_publisher(&writer2);
+    REQUIRE(msgq_msg_reserve(&writer, 100) == NULL);
+    REQUIRE(errno == EADDRINUSE);
+    msgq_close_queue(&writer2);
+  }
+
+  msgq_close_queue(&reader);
+  msgq_close_queue(&writer);
+}
+
+TEST_CASE("Lease is dropped when the writer laps the reader"){
+  remove_queue("test_queue");
+  msgq_queue_t writer, reader;
+  REQUIRE(msgq_new_queue(&writer, "test_queue", TEST_QUEUE_SIZE) == 0);
+  REQUIRE(msgq_new_queue(&reader, "test_queue", TEST_QUEUE_SIZE) == 0);
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  REQUIRE(send_message(&writer, 'a', 100) == 100);
+
+  msgq_msg_t msg;
+  REQUIRE(msgq_msg_recv_lease(&msg, &reader) == 100);
+  REQUIRE(msg.data[0] == 'a');
+  REQUIRE(msgq_lease_valid(&reader));
+
+  SECTION("Release"){
+    msgq_lease_release(&reader);
+    REQUIRE_FALSE(msgq_lease_valid(&reader));
+  }
+
+  SECTION("Lapped"){
+    // 112 bytes per message, the lease survives until the writer wraps around to it
+    for (int i = 0; i < 8; i++){
+      REQUIRE(send_message(&writer, 'b', 100) == 100);
+    }
+    REQUIRE(msgq_lease_valid(&reader));
+
+    REQUIRE(send_message(&writer, 'c', 100) == 100);
+    REQUIRE(send_message(&writer, 'c', 100) == 100);
+    REQUIRE_FALSE(msgq_lease_valid(&reader));
+  }
+
+  msgq_close_queue(&reader);
+  msgq_close_queue(&writer);
+}
+
+TEST_CASE("msgq_msg_recv_batch"){
+  remove_queue("test_queue");
+  msgq_queue_t writer, reader;
+  REQUIRE(msgq_new_queue(&writer, "test_queue", TEST_QUEUE_SIZE) == 0);
+  REQUIRE(msgq_new_queue(&reader, "test_queue", TEST_QUEUE_SIZE) == 0);
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  std::vector<msgq_msg_t> msgs;
+
+  SECTION("max_msgs"){
+    for (int i = 0; i < 5; i++){
+      REQUIRE(send_message(&writer, 'a' + i, 100) == 100);
+    }
+    REQUIRE(msgq_msg_recv_batch(&msgs, 0, &reader) == 0);
+    REQUIRE(msgq_msg_recv_batch(&msgs, 2, &reader) == 2);
+    REQUIRE(msgs[0].data[0] == 'a');
+    REQUIRE(msgs[1].data[0] == 'b');
+
+    REQUIRE(msgq_msg_recv_batch(&msgs, 10, &reader) == 3);
+    REQUIRE(msgs[0].data[0] == 'c');
+    REQUIRE(msgs[2].data[0] == 'e');
+    REQUIRE(msgq_lease_valid(&reader));
+
+    REQUIRE(msgq_msg_recv_batch(&msgs, 10, &reader) == 0);
+    REQUIRE(msgs.empty());
+  }
+
+  SECTION("Conflate"){
+    reader.read_conflate = true;
+    for (int i = 0; i < 5; i++){
+      REQUIRE(send_message(&writer, 'a' + i, 100) == 100);
+    }
+    REQUIRE(msgq_msg_recv_batch(&msgs, 10, &reader) == 1);
+    REQUIRE(msgs[0].data[0] == 'e');
+  }
+
+  SECTION("Wraparound"){
+    // Messages take 112 bytes, the 10th doesn't fit at the end and wraps around
+    for (int i = 0; i < 8; i++){
+      REQUIRE(send_message(&writer, 'a', 100) == 100);
+    }
+    REQUIRE(msgq_msg_recv_batch(&msgs, 10, &reader) == 8);
+
+    for (int i = 0; i < 3; i++){
+      REQUIRE(send_message(&writer, 'x' + i, 100) == 100);
+    }
+    REQUIRE(msgq_msg_recv_batch(&msgs, 10, &reader) == 3);
+    REQUIRE(msgs[0].data == reader.data + 896 + sizeof(int64_t));
+    REQUIRE(msgs[1].data == reader.data + sizeof(int64_t));
+    for (int i = 0; i < 3; i++){
+      REQUIRE(msgs[i].size == 100);
+      REQUIRE(msgs[i].data[0] == 'x' + i);
+    }
+    REQUIRE(msgq_lease_valid(&reader));
+  }
+
+  SECTION("Lapped while draining"){
+    for (int i = 0; i < 5; i++){
+      REQUIRE(send_message(&writer, 'a', 100) == 100);
+    }
+    REQUIRE(msgq_msg_recv_batch(&msgs, 10, &reader) == 5);
+
+    // The writer wraps around and overwrites the first message of the batch while it is still being used
+    for (int i = 0; i < 4; i++){
+      REQUIRE(send_message(&writer, 'b', 100) == 100);
+    }
+    REQUIRE(msgq_lease_valid(&reader));
+    REQUIRE(send_message(&writer, 'b', 100) == 100);
+    REQUIRE_FALSE(msgq_lease_valid(&reader));
+
+    // The reader wasn't lapped, the rest is still there
+    REQUIRE(msgq_msg_recv_batch(&msgs, 10, &reader) == 5);
+    REQUIRE(msgs[0].data[0] == 'b');
+  }
+
+  SECTION("Lapped before draining"){
+    for (int i = 0; i < 20; i++){
+      REQUIRE(send_message(&writer, 'a', 100) == 100);
+    }
+
+    // Starts over at the write pointer
+    REQUIRE(msgq_msg_recv_batch(&msgs, 10, &reader) == 0);
+    REQUIRE(writer.readers[reader.reader_id].resets == 1);
+    REQUIRE(send_message(&writer, 'b', 100) == 100);
+    REQUIRE(msgq_msg_recv_batch(&msgs, 10, &reader) == 1);
+    REQUIRE(msgs[0].data[0] == 'b');
+  }
+
+  msgq_lease_release(&reader);
+  msgq_close_queue(&reader);
+  msgq_close_queue(&writer);
+}
+
+TEST_CASE("Reader eviction and slot reuse"){
+  remove_queue("test_queue");
+  setenv("MSGQ_NUM_READERS", "2", 1);
+  msgq_queue_t writer, reader1, reader2, reader3;
+  REQUIRE(msgq_new_queue(&writer, "test_queue", TEST_QUEUE_SIZE) == 0);
+  unsetenv("MSGQ_NUM_READERS");
+
+  REQUIRE(msgq_new_queue(&reader1, "test_queue", TEST_QUEUE_SIZE) == 0);
+  REQUIRE(msgq_new_queue(&reader2, "test_queue", TEST_QUEUE_SIZE) == 0);
+  REQUIRE(msgq_new_queue(&reader3, "test_queue", TEST_QUEUE_SIZE) == 0);
+  REQUIRE(reader3.num_reader_slots == 2);
+
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader1);
+  REQUIRE(send_message(&writer, 'a', 100) == 100);
+  msgq_init_subscriber(&reader2);
+  REQUIRE(*writer.num_readers == 2);
+
+  SECTION("The reader furthest behind is evicted"){
+    msgq_init_subscriber(&reader3);
+    REQUIRE(reader3.reader_id == reader1.reader_id);
+    REQUIRE(reader1.read_uid_local != writer.readers[reader1.reader_id].read_uid);
+
+    REQUIRE(send_message(&writer, 'b', 100) == 100);
+    msgq_msg_t msg;
+    REQUIRE(msgq_msg_recv(&msg, &reader3) == 100);
+    REQUIRE(msg.data[0] == 'b');
+    msgq_msg_close(&msg);
+  }
+
+  SECTION("A closed slot is reused"){
+    int id = reader2.reader_id;
+    msgq_close_queue(&reader2);
+    REQUIRE(writer.readers[id].read_uid == 0);
+
+    msgq_init_subscriber(&reader3);
+    REQUIRE(reader3.reader_id == id);
+    REQUIRE(reader1.read_uid_local == writer.readers[reader1.reader_id].read_uid);
+    REQUIRE(*writer.num_readers == 2);
+  }
+
+  msgq_close_queue(&reader3);
+  msgq_close_queue(&reader2);
+  msgq_close_queue(&reader1);
+  msgq_close_queue(&writer);
+}
+
+TEST_CASE("Reader telemetry survives a publisher restart"){
+  remove_queue("test_queue");
+  msgq_queue_t writer, reader;
+  REQUIRE(msgq_new_queue(&writer, "test_queue", TEST_QUEUE_SIZE) == 0);
+  REQUIRE(msgq_new_queue(&reader, "test_queue", TEST_QUEUE_SIZE) == 0);
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+  int id = reader.reader_id;
+  REQUIRE(writer.readers[id].resets == 0);
+
+  // Lap the reader
+  for (int i = 0; i < 20; i++){
+    REQUIRE(send_message(&writer, 'a', 100) == 100);
+  }
+  msgq_msg_t msg;
+  REQUIRE(msgq_msg_recv(&msg, &reader) == 0);
+  REQUIRE(writer.readers[id].resets == 1);
+
+  // The reader gets its slot back, skipping what was sent in the meantime
+  msgq_init_publisher(&writer);
+  REQUIRE(send_message(&writer, 'b', 100) == 100);
+  REQUIRE(msgq_msg_recv(&msg, &reader) == 0);
+  REQUIRE(reader.reader_id == id);
+  REQUIRE(writer.readers[id].resets == 2);
+
+  msgq_close_queue(&reader);
+  msgq_close_queue(&writer);
+}
+
+TEST_CASE("Wakeups"){
+  remove_queue("test_queue_a");
+  remove_queue("test_queue_b");
+  msgq_queue_t writer_a, reader_a, writer_b, reader_b;
+  REQUIRE(msgq_new_queue(&writer_a, "test_queue_a", TEST_QUEUE_SIZE) == 0);
+  REQUIRE(msgq_new_queue(&reader_a, "test_queue_a", TEST_QUEUE_SIZE) == 0);
+  REQUIRE(msgq_new_queue(&writer_b, "test_queue_b", TEST_QUEUE_SIZE) == 0);
+  REQUIRE(msgq_new_queue(&reader_b, "test_queue_b", TEST_QUEUE_SIZE) == 0);
+  msgq_init_publisher(&writer_a);
+  msgq_init_subscriber(&reader_a);
+  msgq_init_publisher(&writer_b);
+  msgq_init_subscriber(&reader_b);
+
+  auto start = std::chrono::steady_clock::now();
+  std::thread publisher([&](){
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    send_message(&writer_b, 'a', 100);
+  });
+  // Don't leave the thread running if a check below fails
+  struct Joiner { std::thread &t; ~Joiner(){ if (t.joinable()) t.join(); } } joiner{publisher};
+
+  SECTION("msgq_poll"){
+    msgq_pollitem_t items[2] = {{&reader_a, 0}, {&reader_b, 0}};
+    REQUIRE(msgq_poll(items, 2, 2000) == 1);
+    REQUIRE(items[0].revents == 0);
+    REQUIRE(items[1].revents == 1);
+  }
+
+  SECTION("msgq_waitset_wait"){
+    msgq_waitset_t ws;
+    REQUIRE(msgq_waitset_init(&ws) == 0);
+    REQUIRE(msgq_waitset_add(&ws, &reader_a) == 0);
+    REQUIRE(msgq_waitset_add(&ws, &reader_b) == 1);
+
+    std::vector<size_t> ready;
+    REQUIRE(msgq_waitset_wait(&ws, &ready, 2000) == 1);
+    REQUIRE(ready == std::vector<size_t>{1});
+
+    // Stays ready until it is drained
+    REQUIRE(msgq_waitset_wait(&ws, &ready, 0) == 1);
+    msgq_msg_t msg;
+    REQUIRE(msgq_msg_recv(&msg, &reader_b) == 100);
+    msgq_msg_close(&msg);
+    REQUIRE(msgq_waitset_wait(&ws, &ready, 0) == 0);
+
+    msgq_waitset_close(&ws);
+  }
+
+  SECTION("msgq_poll on a queue of a wait set"){
+    msgq_waitset_t ws;
+    REQUIRE(msgq_waitset_init(&ws) == 0);
+    REQUIRE(msgq_waitset_add(&ws, &reader_b) == 0);
+    uint64_t ws_doorbell = reader_b.doorbell_local;
+
+    msgq_pollitem_t items[1] = {{&reader_b, 0}};
+    REQUIRE(msgq_poll(items, 1, 2000) == 1);
+
+    // Handed back to the wait set, which is told to look at it
+    REQUIRE(reader_b.doorbell_local == ws_doorbell);
+    REQUIRE(reader_b.readers[reader_b.reader_id].doorbell == ws_doorbell);
+    std::vector<size_t> ready;
+    REQUIRE(msgq_waitset_wait(&ws, &ready, 0) == 1);
+
+    msgq_waitset_close(&ws);
+  }
+
+  // Woken up by the publisher, not by the timeout
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+  REQUIRE(elapsed.count() < 1000);
+  publisher.join();
+
+  msgq_close_queue(&reader_b);
+  msgq_close_queue(&writer_b);
+  msgq_close_queue(&reader_a);
+  msgq_close_queue(&writer_a);
+}
+
+TEST_CASE("Attaching to an incompatible layout"){
+  remove_queue("test_queue");
+
+  SECTION("Different version"){
+    int fd = open(msgq_shm_path("test_queue").c_str(), O_RDWR | O_CREAT, 0664);
+    REQUIRE(fd >= 0);
+    uint64_t layout = ((uint64_t)(MSGQ_VERSION - 1) << 32) | NUM_READERS;
+    REQUIRE(write(fd, &layout, sizeof(layout)) == sizeof(layout));
+    close(fd);
+
+    // Like a queue allocated with new, fields aren't initialized
+    msgq_queue_t q;
+    q.mmap_p = (char *)0x1;
+    q.reader_id = 12345;
+    REQUIRE(msgq_new_queue(&q, "test_queue", TEST_QUEUE_SIZE) == -1);
+    REQUIRE(errno == EPROTO);
+
+    // Sockets close the queue after a failed connect
+    REQUIRE(q.mmap_p == NULL);
+    msgq_close_queue(&q);
+  }
+
+  SECTION("Different reader capacity"){
+    setenv("MSGQ_NUM_READERS", "4", 1);
+    msgq_queue_t writer;
+    REQUIRE(msgq_new_queue(&writer, "test_queue", TEST_QUEUE_SIZE) == 0);
+    unsetenv("MSGQ_NUM_READERS");
+
+    // The reader capacity of whoever set up the queue wins
+    msgq_queue_t reader;
+    REQUIRE(msgq_new_queue(&reader, "test_queue", TEST_QUEUE_SIZE) == 0);
+    REQUIRE(reader.num_reader_slots == 4);
+    REQUIRE(reader.data - reader.mmap_p == writer.data - writer.mmap_p);
+
+    msgq_close_queue(&reader);
+    msgq_close_queue(&writer);
+  }
+
+  remove_queue("test_queue");
+}
@@ -0,0 +1,109 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+
+#include "cereal/services.h"
+#include "cereal/messaging/msgq.h"
+
+// Live view of the msgq telemetry of all services, similar to top.
+// Only maps the queues read-only, so it doesn't disturb the processes using them.
+//
+// usage: msgqstat [interval in seconds] [-1]
+//   -1: print a single sample and exit, rates are measured over one interval
+
+std::atomic<bool> do_exit = false;
+static void set_do_exit(int sig) {
+  do_exit = true;
+}
+
+static uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::string process_name(uint64_t uid) {
+  std::string comm;
+  std::ifstream f("/proc/" + std::to_string(uid & 0xFFFFFFFF) + "/comm");
+  std::getline(f, comm);
+  return comm.empty() ? "?" : comm;
+}
+
+static void print_stats(const std::map<std::string, msgq_stats_t> &prev, const std::map<std::string, msgq_stats_t> &cur, double dt) {
+  printf("%-28s %9s %10s %12s %7s %6s\n", "SERVICE", "MSGS/S", "KB/S", "MSGS", "SIZE_MB", "MAXLAG");
+  printf("  %-10s %-16s %7s %10s %10s %12s %10s\n", "PID", "PROCESS", "VALID", "RESETS", "LAG_MSGS", "LAG_KB", "LAST_MS");
+
+  uint64_t t = now_ns();
+  for (const auto &[name, stats] : cur) {
+    double msgs_s = 0, kb_s = 0;
+    auto it = prev.find(name);
+    if (it != prev.end() && dt > 0) {
+      msgs_s = (stats.write_count - it->second.write_count) / dt;
+      kb_s = (stats.write_bytes - it->second.write_bytes) / 1024. / dt;
+    }
+
+    // Worst reader lag as a fraction of the segment, how close the slowest reader is to being lapped
+    uint64_t max_lag = 0;
+    for (const auto &r : stats.readers) {
+      max_lag = std::max(max_lag, r.lag_bytes);
+    }
+
+    printf("%-28s %9.1f %10.1f %12" PRIu64 " %7.1f %5.1f%%\n", name.c_str(), msgs_s, kb_s, stats.write_count,
+           stats.size / (1024. * 1024.), 100. * max_lag / stats.size);
+
+    for (const auto &r : stats.readers) {
+      double last_ms = (r.read_time == 0 || r.read_time > t) ? -1 : (t - r.read_time) * 1e-6;
+      printf("  %-10" PRIu64 " %-16s %7s %10" PRIu64 " %10" PRIu64 " %12.1f %10.1f\n", r.uid & 0xFFFFFFFF, process_name(r.uid).c_str(),
+             r.valid ? "yes" : "no", r.resets, r.lag_msgs, r.lag_bytes / 1024., last_ms);
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  signal(SIGINT, set_do_exit);
+  signal(SIGTERM, set_do_exit);
+
+  double interval = 1.0;
+  bool once = false;
+  for (int i = 1; i < argc; i++) {
+    if (std::string(argv[i]) == "-1") {
+      once = true;
+    } else {
+      interval = std::max(0.1, std::atof(argv[i]));
+    }
+  }
+
+  std::map<std::string, msgq_stats_t> prev;
+  uint64_t prev_t = 0;
+  while (!do_exit) {
+    std::map<std::string, msgq_stats_t> cur;
+    for (const auto& it : services) {
+      msgq_stats_t stats;
+      if (msgq_get_stats(it.name, &stats) == 0) {
+        cur[it.name] = stats;
+      }
+    }
+    uint64_t t = now_ns();
+
+    if (!once || prev_t != 0) {
+      if (!once) {
+        printf("\033[2J\033[H");  // clear screen
+      }
+      print_stats(prev, cur, prev_t == 0 ? 0 : (t - prev_t) * 1e-9);
+      fflush(stdout);
+
+      if (once) break;
+    }
+
+    prev = cur;
+    prev_t = t;
+    std::this_thread::sleep_for(std::chrono::milliseconds((int)(interval * 1000)));
+  }
+  return 0;
+}
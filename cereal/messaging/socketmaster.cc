@@ -1,11 +1,16 @@
 #include <time.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <string>
+#include <string_view>
 #include <mutex>
+#include <stdexcept>
+#include <unordered_map>
 
 #include "cereal/services.h"
 #include "cereal/messaging/messaging.h"
+#include "cereal/messaging/trace.h"
 
 const bool SIMULATION = (getenv("SIMULATION") != nullptr) && (std::string(getenv("SIMULATION")) == "1");
 
@@ -15,11 +20,20 @@ static inline uint64_t nanos_since_boot() {
   return t.tv_sec * 1000000000ULL + t.tv_nsec;
 }
 
+static int service_index(const char *name) {
+  static const std::unordered_map<std::string_view, int> index = []() {
+    std::unordered_map<std::string_view, int> index;
+    for (int i = 0; i < NUM_SERVICES; i++) index[services[i].name] = i;
+    return index;
+  }();
+
+  auto it = index.find(name);
+  return it == index.end() ? -1 : it->second;
+}
+
 static const service *get_service(const char *name) {
-  for (const auto &it : services) {
-    if (strcmp(it.name, name) == 0) return &it;
-  }
-  return nullptr;
+  int i = service_index(name);
+  return i < 0 ? nullptr : &services[i];
 }
 
 static inline bool inList(const std::vector<const char *> &list, const char *value) {
@@ -44,84 +58,163 @@ private:
 
 MessageContext message_context;
 
+// Reads events in place when they are 8-byte aligned, like msgq messages in the ring.
+// The capnp reader is constructed in reused storage, so reading doesn't allocate.
+struct EventReader {
+  void *allocated_msg_reader = nullptr;
+  capnp::FlatArrayMessageReader *msg_reader = nullptr;
+  AlignedBuffer aligned_buf;
+
+  EventReader() {
+    allocated_msg_reader = malloc(sizeof(capnp::FlatArrayMessageReader));
+    msg_reader = new (allocated_msg_reader) capnp::FlatArrayMessageReader({});
+  }
+  EventReader(const EventReader &) = delete;
+  EventReader &operator=(const EventReader &) = delete;
+  ~EventReader() {
+    msg_reader->~FlatArrayMessageReader();
+    free(allocated_msg_reader);
+  }
+
+  cereal::Event::Reader read(const char *data, size_t size) {
+    kj::ArrayPtr<const capnp::word> words;
+    if (((uintptr_t)data % sizeof(capnp::word)) == 0) {
+      words = kj::ArrayPtr<const capnp::word>((const capnp::word *)data, size / sizeof(capnp::word));
+    } else {
+      words = aligned_buf.align(data, size);
+    }
+
+    msg_reader->~FlatArrayMessageReader();
+    capnp::ReaderOptions options;
+    options.traversalLimitInWords = kj::maxValue; // Don't limit
+    msg_reader = new (allocated_msg_reader) capnp::FlatArrayMessageReader(words, options);
+    return msg_reader->getRoot<cereal::Event>();
+  }
+};
+
 struct SubMaster::SubMessage {
   std::string name;
+  int id;
   SubSocket *socket = nullptr;
   int freq = 0;
   bool updated = false, alive = false, valid = true, ignore_alive;
   uint64_t rcv_time = 0, rcv_frame = 0;
-  void *allocated_msg_reader = nullptr;
   bool is_polled = false;
-  capnp::FlatArrayMessageReader *msg_reader = nullptr;
-  AlignedBuffer aligned_buf;
+  bool conflate = true;
+  uint64_t dropped = 0;
   cereal::Event::Reader event;
+  // Messages of the last update, oldest first. A conflated service has a queue of one.
+  std::vector<cereal::Event::Reader> queue;
+  std::vector<EventReader> readers;  // one per queue slot
+
+  void push(cereal::Event::Reader event) {
+    if (queue.size() == readers.size()) {
+      queue.erase(queue.begin());
+      dropped += !conflate;
+    }
+    queue.push_back(event);
+  }
 };
 
 SubMaster::SubMaster(const std::vector<const char *> &service_list, const std::vector<const char *> &poll,
-                     const char *address, const std::vector<const char *> &ignore_alive) {
+                     const char *address, const std::vector<const char *> &ignore_alive,
+                     const std::vector<const char *> &no_conflate, size_t queue_size) {
+  assert(queue_size > 0);
   poller_ = Poller::create();
+  services_.resize(NUM_SERVICES, nullptr);
   for (auto name : service_list) {
     const service *serv = get_service(name);
     assert(serv != nullptr);
-    SubSocket *socket = SubSocket::create(message_context.context(), name, address ? address : "127.0.0.1", true);
+    bool conflate = !inList(no_conflate, name);
+    SubSocket *socket = SubSocket::create(message_context.context(), name, address ? address : "127.0.0.1", conflate);
     assert(socket != 0);
     bool is_polled = inList(poll, name) || poll.empty();
     if (is_polled) poller_->registerSocket(socket);
     SubMessage *m = new SubMessage{
       .name = name,
+      .id = service_index(name),
       .socket = socket,
       .freq = serv->frequency,
       .ignore_alive = inList(ignore_alive, name),
-      .allocated_msg_reader = malloc(sizeof(capnp::FlatArrayMessageReader)),
-      .is_polled = is_polled};
-    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader({});
-    messages_[socket] = m;
-    services_[name] = m;
+      .is_polled = is_polled,
+      .conflate = conflate,
+      .readers = std::vector<EventReader>(conflate ? 1 : queue_size)};
+    m->queue.reserve(m->readers.size());
+    messages_.push_back(m);
+    services_[m->id] = m;
+    sockets_[socket] = m;
   }
 }
 
 void SubMaster::update(int timeout) {
-  for (auto &kv : messages_) kv.second->updated = false;
+  for (auto m : messages_) {
+    m->updated = false;
+    m->queue.clear();
+  }
 
   auto sockets = poller_->poll(timeout);
 
   // add non-polled sockets for non-blocking receive
-  for (auto &kv : messages_) {
-    SubMessage *m = kv.second;
-    SubSocket *s = kv.first;
-    if (!m->is_polled) sockets.push_back(s);
+  for (auto m : messages_) {
+    if (!m->is_polled) sockets.push_back(m->socket);
   }
 
   uint64_t current_time = nanos_since_boot();
 
-  std::vector<std::pair<std::string, cereal::Event::Reader>> messages;
+  std::vector<std::pair<SubMessage *, cereal::Event::Reader>> messages;
 
   for (auto s : sockets) {
-    Message *msg = s->receive(true);
-    if (msg == nullptr) continue;
-
-    SubMessage *m = messages_.at(s);
+    SubMessage *m = sockets_.at(s);
+    if (m->conflate) {
+      const char *data = nullptr;
+      size_t size = 0;
+      if (!s->receiveLease(&data, &size, true)) continue;
+      m->queue.push_back(m->readers[0].read(data, size));
+    } else {
+      // Everything since the last update, only the newest ones if it doesn't fit the queue
+      if (s->receiveBatch(&batch_) == 0) continue;
+      size_t skip = batch_.size() > m->readers.size() ? batch_.size() - m->readers.size() : 0;
+      m->dropped += skip;
+      for (size_t i = skip; i < batch_.size(); i++) {
+        m->queue.push_back(m->readers[i - skip].read(batch_[i].data, batch_[i].size));
+      }
+    }
 
-    m->msg_reader->~FlatArrayMessageReader();
-    capnp::ReaderOptions options;
-    options.traversalLimitInWords = kj::maxValue; // Don't limit
-    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader(m->aligned_buf.align(msg), options);
-    delete msg;
-    messages.push_back({m->name, m->msg_reader->getRoot<cereal::Event>()});
+    for (auto &event : m->queue) trace_receive(m->id, event.getLogMonoTime());
+    messages.push_back({m, m->queue.back()});
   }
 
-  update_msgs(current_time, messages);
+  apply_msgs(current_time, messages);
+
+  // The last message of a socket that had no new data is still read in place,
+  // it can't be trusted anymore once the publisher lapped it
+  for (auto m : messages_) {
+    if (!m->updated && m->rcv_frame > 0 && !m->socket->leaseValid()) {
+      m->valid = false;
+    }
+  }
 }
 
 void SubMaster::update_msgs(uint64_t current_time, const std::vector<std::pair<std::string, cereal::Event::Reader>> &messages){
-  if (++frame == UINT64_MAX) frame = 1;
+  for (auto m : messages_) m->queue.clear();
 
+  std::vector<std::pair<SubMessage *, cereal::Event::Reader>> msgs;
   for (auto &kv : messages) {
-    auto m_find = services_.find(kv.first);
-    if (m_find == services_.end()){
-      continue;
+    int i = service_index(kv.first.c_str());
+    if (i >= 0 && services_[i] != nullptr) {
+      services_[i]->push(kv.second);
+      trace_receive(i, kv.second.getLogMonoTime());
+      msgs.push_back({services_[i], kv.second});
     }
-    SubMessage *m = m_find->second;
+  }
+  apply_msgs(current_time, msgs);
+}
+
+void SubMaster::apply_msgs(uint64_t current_time, const std::vector<std::pair<SubMessage *, cereal::Event::Reader>> &messages){
+  if (++frame == UINT64_MAX) frame = 1;
+
+  for (auto &kv : messages) {
+    SubMessage *m = kv.first;
     m->event = kv.second;
     m->updated = true;
     m->rcv_time = current_time;
@@ -131,8 +224,7 @@ void SubMaster::update_msgs(uint64_t current_time, const std::vector<std::pair<s
   }
 
   if (!SIMULATION) {
-    for (auto &kv : messages_) {
-      SubMessage *m = kv.second;
+    for (auto m : messages_) {
       m->alive = (m->freq <= (1e-5) || ((current_time - m->rcv_time) * (1e-9)) < (10.0 / m->freq));
     }
   }
@@ -140,8 +232,7 @@ void SubMaster::update_msgs(uint64_t current_time, const std::vector<std::pair<s
 
 bool SubMaster::all_(const std::vector<const char *> &service_list, bool valid, bool alive) {
   int found = 0;
-  for (auto &kv : messages_) {
-    SubMessage *m = kv.second;
+  for (auto m : messages_) {
     if (service_list.size() == 0 || inList(service_list, m->name.c_str())) {
       found += (!valid || m->valid) && (!alive || (m->alive || m->ignore_alive));
     }
@@ -150,67 +241,208 @@ bool SubMaster::all_(const std::vector<const char *> &service_list, bool valid,
 }
 
 void SubMaster::drain() {
+  std::vector<MessageView> msgs;
   while (true) {
     auto polls = poller_->poll(0);
     if (polls.size() == 0)
       break;
 
     for (auto sock : polls) {
-      Message *msg = sock->receive(true);
-      delete msg;
+      if (sock->receiveBatch(&msgs) == 0) continue;
+
+      // The lease moved from the messages update() read in place to the batch,
+      // so keep the newest drained message instead. It isn't marked as updated.
+      SubMessage *m = sockets_.at(sock);
+      m->queue.clear();
+      m->event = m->readers[0].read(msgs.back().data, msgs.back().size);
+      m->valid = m->event.getValid();
     }
   }
 }
 
+SubMaster::SubMessage *SubMaster::get(ServiceId id) const {
+  SubMessage *m = services_[(int)id];
+  if (m == nullptr) throw std::out_of_range("service not subscribed");
+  return m;
+}
+
+SubMaster::SubMessage *SubMaster::get(const char *name) const {
+  int i = service_index(name);
+  if (i < 0) throw std::out_of_range(std::string("unknown service ") + name);
+  return get((ServiceId)i);
+}
+
 bool SubMaster::updated(const char *name) const {
-  return services_.at(name)->updated;
+  return get(name)->updated;
 }
 
 bool SubMaster::alive(const char *name) const {
-  return services_.at(name)->alive;
+  return get(name)->alive;
 }
 
 bool SubMaster::valid(const char *name) const {
-  return services_.at(name)->valid;
+  return get(name)->valid;
 }
 
 uint64_t SubMaster::rcv_frame(const char *name) const {
-  return services_.at(name)->rcv_frame;
+  return get(name)->rcv_frame;
 }
 
 uint64_t SubMaster::rcv_time(const char *name) const {
-  return services_.at(name)->rcv_time;
+  return get(name)->rcv_time;
 }
 
 cereal::Event::Reader &SubMaster::operator[](const char *name) const {
-  return services_.at(name)->event;
-};
+  return get(name)->event;
+}
+
+const std::vector<cereal::Event::Reader> &SubMaster::received(const char *name) const {
+  return get(name)->queue;
+}
+
+uint64_t SubMaster::dropped(const char *name) const {
+  return get(name)->dropped;
+}
+
+bool SubMaster::updated(ServiceId id) const {
+  return get(id)->updated;
+}
+
+bool SubMaster::alive(ServiceId id) const {
+  return get(id)->alive;
+}
+
+bool SubMaster::valid(ServiceId id) const {
+  return get(id)->valid;
+}
+
+uint64_t SubMaster::rcv_frame(ServiceId id) const {
+  return get(id)->rcv_frame;
+}
+
+uint64_t SubMaster::rcv_time(ServiceId id) const {
+  return get(id)->rcv_time;
+}
+
+cereal::Event::Reader &SubMaster::operator[](ServiceId id) const {
+  return get(id)->event;
+}
+
+const std::vector<cereal::Event::Reader> &SubMaster::received(ServiceId id) const {
+  return get(id)->queue;
+}
+
+uint64_t SubMaster::dropped(ServiceId id) const {
+  return get(id)->dropped;
+}
 
 SubMaster::~SubMaster() {
   delete poller_;
-  for (auto &kv : messages_) {
-    SubMessage *m = kv.second;
-    m->msg_reader->~FlatArrayMessageReader();
-    free(m->allocated_msg_reader);
+  for (auto m : messages_) {
     delete m->socket;
     delete m;
   }
 }
 
 PubMaster::PubMaster(const std::vector<const char *> &service_list) {
+  sockets_.resize(NUM_SERVICES, nullptr);
   for (auto name : service_list) {
     assert(get_service(name) != nullptr);
     PubSocket *socket = PubSocket::create(message_context.context(), name);
     assert(socket);
-    sockets_[name] = socket;
+    sockets_[service_index(name)] = socket;
   }
 }
 
+PubSocket *PubMaster::get(ServiceId id) const {
+  PubSocket *socket = sockets_[(int)id];
+  if (socket == nullptr) throw std::out_of_range("service not published");
+  return socket;
+}
+
+PubSocket *PubMaster::get(const char *name) const {
+  int i = service_index(name);
+  if (i < 0) throw std::out_of_range(std::string("unknown service ") + name);
+  return get((ServiceId)i);
+}
+
+static int send_builder(PubSocket *socket, int id, MessageBuilder &msg) {
+  if (trace_enabled()) {
+    trace_record(TRACE_PUBLISH, id, msg.getRoot<cereal::Event>().getLogMonoTime());
+  }
+
+  // Serialize straight into the socket's buffer, for msgq that is the ring itself
+  size_t size = msg.getSerializedSize();
+  char *buf = socket->reserve(size);
+  if (buf == nullptr) return -1;
+
+  msg.serializeToBuffer((unsigned char *)buf, size);
+  return socket->commit(size);
+}
+
+static int send_bytes(PubSocket *socket, int id, capnp::byte *data, size_t size) {
+  if (trace_enabled()) {
+    AlignedBuffer aligned_buf;
+    capnp::FlatArrayMessageReader msg(aligned_buf.align((const char *)data, size));
+    trace_record(TRACE_PUBLISH, id, msg.getRoot<cereal::Event>().getLogMonoTime());
+  }
+  return socket->send((char *)data, size);
+}
+
+int PubMaster::send(const char *name, capnp::byte *data, size_t size) {
+  return send_bytes(get(name), service_index(name), data, size);
+}
+
 int PubMaster::send(const char *name, MessageBuilder &msg) {
-  auto bytes = msg.toBytes();
-  return send(name, bytes.begin(), bytes.size());
+  return send_builder(get(name), service_index(name), msg);
+}
+
+int PubMaster::send(ServiceId id, capnp::byte *data, size_t size) {
+  return send_bytes(get(id), (int)id, data, size);
+}
+
+int PubMaster::send(ServiceId id, MessageBuilder &msg) {
+  return send_builder(get(id), (int)id, msg);
 }
 
 PubMaster::~PubMaster() {
-  for (auto s : sockets_) delete s.second;
+  for (auto s : sockets_) delete s;
+}
+
+PooledMessageBuilder::PooledMessageBuilder(size_t initial_size) {
+  segment_ = kj::heapArray<capnp::word>(initial_size / sizeof(capnp::word));
+  memset(segment_.begin(), 0, segment_.size() * sizeof(capnp::word));
+}
+
+MessageBuilder &PooledMessageBuilder::reset() {
+  if (msg_) {
+    // A message that didn't fit spilled into malloc'ed segments, grow to fit it next time
+    size_t words = 0;
+    auto segments = msg_->getSegmentsForOutput();
+    if (segments.size() > 1) {
+      for (auto &segment : segments) words += segment.size();
+    }
+    msg_.reset();
+
+    if (words > segment_.size()) {
+      segment_ = kj::heapArray<capnp::word>(words + words / 4);
+      memset(segment_.begin(), 0, segment_.size() * sizeof(capnp::word));
+    }
+  }
+
+  msg_.emplace(segment_.asPtr());
+  return *msg_;
+}
+
+kj::ArrayPtr<capnp::byte> PooledMessageBuilder::toBytes() {
+  assert(msg_);
+  size_t words = capnp::computeSerializedSizeInWords(*msg_);
+  if (bytes_.size() < words) {
+    bytes_ = kj::heapArray<capnp::word>(words + words / 4);
+  }
+
+  kj::ArrayPtr<capnp::byte> out = bytes_.slice(0, words).asBytes();
+  kj::ArrayOutputStream stream(out);
+  capnp::writeMessage(stream, *msg_);
+  return out;
 }
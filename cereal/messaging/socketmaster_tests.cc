@@ -0,0 +1,45 @@
+#include <cstdlib>
+
+#include "catch2/catch.hpp"
+#include "cereal/messaging/messaging.h"
+
+TEST_CASE("SubMaster keeps the last batch over a quiet update"){
+  // The default receiveBatch is only used by the non-msgq backends
+  setenv("ZMQ", "1", 1);
+
+  PubMaster pm({"carState"});
+  // carState isn't polled, so every update receives from its socket
+  SubMaster sm({"carState", "controlsState"}, {"controlsState"}, nullptr, {}, {"carState"});
+
+  // ZMQ drops messages sent before the subscription is set up
+  uint64_t sent = 0;
+  for (int i = 0; i < 100 && !sm.updated("carState"); i++){
+    MessageBuilder msg;
+    auto event = msg.initEvent();
+    event.initCarState().setVEgo(i + 1);
+    sent = event.getLogMonoTime();
+    REQUIRE(pm.send("carState", msg) > 0);
+    sm.update(10);
+  }
+  REQUIRE(sm.updated("carState"));
+
+  // Drain anything sent after the first message that got through
+  while (sm.updated("carState")){
+    sm.update(10);
+  }
+  uint64_t mono_time = sm["carState"].getLogMonoTime();
+  float v_ego = sm["carState"].getCarState().getVEgo();
+  REQUIRE(mono_time > 0);
+  REQUIRE(mono_time <= sent);
+
+  for (int i = 0; i < 3; i++){
+    sm.update(0);
+    REQUIRE(!sm.updated("carState"));
+    REQUIRE(sm.received("carState").empty());
+    REQUIRE(sm.valid("carState"));
+    REQUIRE(sm["carState"].getLogMonoTime() == mono_time);
+    REQUIRE(sm["carState"].getCarState().getVEgo() == v_ego);
+  }
+
+  unsetenv("ZMQ");
+}
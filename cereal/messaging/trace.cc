@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <mutex>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cereal/messaging/msgq.h"
+#include "cereal/messaging/trace.h"
+
+const bool TRACE = (getenv("CEREAL_TRACE") != nullptr) && (std::string(getenv("CEREAL_TRACE")) == "1");
+
+bool trace_enabled() {
+  return TRACE;
+}
+
+trace_ring_t *trace_ring_open(bool writable) {
+  std::string full_path = msgq_shm_path("cereal_trace");
+  int fd = open(full_path.c_str(), writable ? (O_RDWR | O_CREAT) : O_RDONLY, 0664);
+  if (fd < 0) return nullptr;
+
+  // All processes size the ring the same, so whoever comes first grows it
+  struct stat st;
+  if (fstat(fd, &st) != 0 || ((size_t)st.st_size < sizeof(trace_ring_t) && (!writable || ftruncate(fd, sizeof(trace_ring_t)) != 0))) {
+    close(fd);
+    return nullptr;
+  }
+
+  void *mem = mmap(NULL, sizeof(trace_ring_t), writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  return mem == MAP_FAILED ? nullptr : (trace_ring_t *)mem;
+}
+
+static trace_ring_t *trace_ring() {
+  static std::once_flag init_flag;
+  static trace_ring_t *ring = nullptr;
+
+  std::call_once(init_flag, []() {
+    ring = trace_ring_open(true);
+    if (ring == nullptr) {
+      std::cout << "Warning, could not open trace ring: " << msgq_shm_path("cereal_trace") << std::endl;
+    }
+  });
+  return ring;
+}
+
+static void trace_write(trace_ring_t *ring, uint64_t t, TraceEventType type, int service, uint64_t id, int upstream_service, uint64_t upstream_id) {
+  // Seqlock per event: readers skip events whose seq changed while they copied them
+  uint64_t pos = ring->head.fetch_add(1, std::memory_order_relaxed);
+  trace_event_t &e = ring->events[pos & (TRACE_RING_SIZE - 1)];
+  e.seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  e.t = t;
+  e.id = id;
+  e.upstream_id = upstream_id;
+  e.pid = getpid();
+  e.service = service;
+  e.upstream_service = upstream_service;
+  e.type = type;
+  e.seq.store(pos + 1, std::memory_order_release);
+}
+
+// What the current thread received, to link the messages it publishes to their inputs
+struct TraceUpstream {
+  int service;
+  uint64_t id;
+  uint64_t count; // receives of the thread up to this one
+};
+
+struct TraceThread {
+  uint64_t receives = 0;
+  std::vector<TraceUpstream> upstream; // latest receive per service
+  std::vector<std::pair<int, uint64_t>> published; // receives of the thread at the last publish per service
+};
+
+static thread_local TraceThread trace_thread;
+
+void trace_record(TraceEventType type, int service, uint64_t id) {
+  trace_ring_t *ring = trace_ring();
+  if (ring == nullptr) return;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  uint64_t t = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+  TraceThread &thread = trace_thread;
+  if (type == TRACE_RECEIVE) {
+    trace_write(ring, t, type, service, id, TRACE_NO_UPSTREAM, 0);
+
+    thread.receives++;
+    auto it = std::find_if(thread.upstream.begin(), thread.upstream.end(), [&](auto &u) { return u.service == service; });
+    if (it == thread.upstream.end()) {
+      thread.upstream.push_back({service, id, thread.receives});
+    } else {
+      *it = {service, id, thread.receives};
+    }
+    return;
+  }
+
+  auto last = std::find_if(thread.published.begin(), thread.published.end(), [&](auto &p) { return p.first == service; });
+  if (last == thread.published.end()) {
+    last = thread.published.insert(last, {service, 0});
+  }
+
+  // One event per upstream message consumed since the last publish of this service
+  bool linked = false;
+  for (const auto &u : thread.upstream) {
+    if (u.count > last->second) {
+      trace_write(ring, t, type, service, id, u.service, u.id);
+      linked = true;
+    }
+  }
+  if (!linked) {
+    trace_write(ring, t, type, service, id, TRACE_NO_UPSTREAM, 0);
+  }
+  last->second = thread.receives;
+}
+
+int trace_read(trace_ring_t *ring, uint64_t pos, trace_sample_t *sample) {
+  trace_event_t &e = ring->events[pos & (TRACE_RING_SIZE - 1)];
+  uint64_t seq = e.seq.load(std::memory_order_acquire);
+  if (seq != pos + 1) {
+    // An older seq or 0 is an event in progress, which is this one unless a writer already lapped it
+    return seq < pos + 1 && ring->head.load(std::memory_order_relaxed) <= pos + TRACE_RING_SIZE ? -1 : 1;
+  }
+
+  sample->t = e.t;
+  sample->id = e.id;
+  sample->upstream_id = e.upstream_id;
+  sample->pid = e.pid;
+  sample->service = e.service;
+  sample->upstream_service = e.upstream_service;
+  sample->type = (TraceEventType)e.type;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return e.seq.load(std::memory_order_relaxed) == seq ? 0 : 1;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Latency tracing. With CEREAL_TRACE=1 every publish and receive through
+// PubMaster/SubMaster (and VisionIpc) is recorded into a shared ring, which
+// tracestat uses to reconstruct per-hop latencies of a processing chain.
+// Messages are identified by their logMonoTime, vision frames by their frame id.
+// A publish also records the upstream messages the publishing thread consumed
+// since its previous publish of that service, one event per upstream service.
+
+#define TRACE_RING_SIZE (1 << 16) // events, must be a power of two
+#define TRACE_VISION_SERVICE 0x8000 // vision streams are traced as TRACE_VISION_SERVICE + VisionStreamType
+#define TRACE_NO_UPSTREAM 0xFFFF
+
+enum TraceEventType : uint8_t {
+  TRACE_PUBLISH = 1,
+  TRACE_RECEIVE = 2,
+};
+
+struct trace_event_t {
+  std::atomic<uint64_t> seq; // ring position + 1 once written, 0 while being written
+  uint64_t t; // CLOCK_BOOTTIME of the event in ns
+  uint64_t id;
+  uint64_t upstream_id; // publishes only, id of the consumed upstream_service message
+  int32_t pid;
+  uint16_t service; // ServiceId or vision stream
+  uint16_t upstream_service; // TRACE_NO_UPSTREAM if nothing new was consumed
+  uint8_t type;
+};
+static_assert(sizeof(trace_event_t) == 48, "trace_event_t should be 48 bytes");
+
+// Plain copy of an event for readers
+struct trace_sample_t {
+  uint64_t t;
+  uint64_t id;
+  uint64_t upstream_id;
+  int pid;
+  int service;
+  int upstream_service;
+  TraceEventType type;
+};
+
+struct trace_ring_t {
+  alignas(64) std::atomic<uint64_t> head; // next ring position to write
+  alignas(64) trace_event_t events[TRACE_RING_SIZE];
+};
+
+bool trace_enabled();
+void trace_record(TraceEventType type, int service, uint64_t id);
+// Maps the ring of the current OPENPILOT_PREFIX, nullptr if it doesn't exist
+trace_ring_t *trace_ring_open(bool writable);
+// Copies the event at ring position pos. Returns 0 on success, -1 if it isn't written yet
+// and 1 if it was already overwritten by a newer event
+int trace_read(trace_ring_t *ring, uint64_t pos, trace_sample_t *sample);
+
+inline void trace_publish(int service, uint64_t id) {
+  if (trace_enabled()) trace_record(TRACE_PUBLISH, service, id);
+}
+
+inline void trace_receive(int service, uint64_t id) {
+  if (trace_enabled()) trace_record(TRACE_RECEIVE, service, id);
+}
@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <iterator>
+#include <map>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "cereal/services.h"
+#include "cereal/messaging/msgq.h"
+#include "cereal/messaging/trace.h"
+
+// Latency of a processing chain, reconstructed from the trace ring that
+// processes started with CEREAL_TRACE=1 write to. Works the same on a replayed route.
+//
+// Each receive of the last service of the chain is walked back to the start:
+// the message is matched to its publish by logMonoTime (frame id for vision streams),
+// which links to the message of the previous service the publisher consumed. If it
+// didn't consume a new one, the upstream of its previous publish is still current.
+//
+// usage: tracestat [--chain vipc_road,modelV2,lateralPlan,sendcan] [interval in seconds] [-1]
+//   -1: print a single sample and exit
+
+const char *DEFAULT_CHAIN = "vipc_road,modelV2,lateralPlan,sendcan";
+const uint64_t MAX_AGE = 5000000000ULL; // ns of events kept around for matching
+
+// VisionStreamType, see cereal/visionipc/visionbuf.h
+const std::pair<const char *, int> VISION_STREAMS[] = {
+  {"vipc_road", 0},
+  {"vipc_driver", 1},
+  {"vipc_wide_road", 2},
+  {"vipc_map", 3},
+  {"vipc_road_qcam", 4},
+};
+
+const double HISTOGRAM_MS[] = {1, 2, 5, 10, 20, 50, 100, 200, 500};
+
+std::atomic<bool> do_exit = false;
+static void set_do_exit(int sig) {
+  do_exit = true;
+}
+
+static int trace_service(const std::string &name) {
+  for (auto &[vision_name, type] : VISION_STREAMS) {
+    if (name == vision_name) return TRACE_VISION_SERVICE + type;
+  }
+  return get_service_index(name.c_str());
+}
+
+struct Publish {
+  uint64_t t;
+  int pid;
+};
+
+struct Link {
+  uint64_t t;
+  uint64_t upstream_id;
+};
+
+class ChainTracer {
+public:
+  ChainTracer(const std::vector<int> &services) : chain(services), latencies(services.size() + 1) {}
+
+  void add(const trace_sample_t &s) {
+    if (std::find(chain.begin(), chain.end(), s.service) == chain.end()) return;
+
+    if (s.type == TRACE_PUBLISH) {
+      publishes[{s.service, s.id}] = {s.t, s.pid};
+      if (s.upstream_service != TRACE_NO_UPSTREAM) {
+        links[{s.pid, s.service, s.upstream_service}].push_back({s.t, s.upstream_id});
+      }
+    } else if (s.type == TRACE_RECEIVE && s.service == chain.back()) {
+      walk(s);
+    }
+  }
+
+  void prune(uint64_t t) {
+    for (auto it = publishes.begin(); it != publishes.end();) {
+      it = (it->second.t + MAX_AGE < t) ? publishes.erase(it) : std::next(it);
+    }
+    for (auto &[key, events] : links) {
+      while (!events.empty() && events.front().t + MAX_AGE < t) events.pop_front();
+    }
+  }
+
+  const std::vector<int> chain;
+  // One entry per hop between publishes, then publish to the final receive, then end to end
+  std::vector<std::vector<uint64_t>> latencies;
+  uint64_t dropped = 0;
+
+private:
+  void walk(const trace_sample_t &end) {
+    size_t n = chain.size();
+    std::vector<uint64_t> pub_t(n);
+    uint64_t id = end.id;
+    for (int i = n - 1; i >= 0; i--) {
+      auto p = publishes.find({chain[i], id});
+      if (p == publishes.end()) {
+        dropped++;
+        return;
+      }
+      pub_t[i] = p->second.t;
+      if (i == 0) break;
+
+      // The upstream message recorded with this publish, or with the publisher's previous one
+      const auto &events = links[{p->second.pid, chain[i], chain[i - 1]}];
+      auto r = std::find_if(events.rbegin(), events.rend(), [&](auto &e) { return e.t <= pub_t[i]; });
+      if (r == events.rend()) {
+        dropped++;
+        return;
+      }
+      id = r->upstream_id;
+    }
+
+    for (size_t i = 1; i < n; i++) {
+      latencies[i - 1].push_back(pub_t[i] - pub_t[i - 1]);
+    }
+    latencies[n - 1].push_back(end.t - pub_t[n - 1]);
+    latencies[n].push_back(end.t - pub_t[0]);
+  }
+
+  std::map<std::pair<int, uint64_t>, Publish> publishes;
+  std::map<std::tuple<int, int, int>, std::deque<Link>> links; // pid, service, upstream service
+};
+
+static double percentile(const std::vector<uint64_t> &sorted, double p) {
+  if (sorted.empty()) return 0;
+  return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))] * 1e-6;
+}
+
+static void print_latencies(ChainTracer &tracer, const std::vector<std::string> &names) {
+  printf("%-36s %8s %9s %9s %9s %9s\n", "HOP", "COUNT", "P50_MS", "P90_MS", "P99_MS", "MAX_MS");
+  for (size_t i = 0; i < tracer.latencies.size(); i++) {
+    std::string hop;
+    if (i + 1 < names.size()) hop = names[i] + " -> " + names[i + 1];
+    else if (i + 1 == names.size()) hop = names[i] + " -> receiver";
+    else hop = "total";
+
+    auto &l = tracer.latencies[i];
+    std::sort(l.begin(), l.end());
+    printf("%-36s %8zu %9.2f %9.2f %9.2f %9.2f\n", hop.c_str(), l.size(), percentile(l, 0.5), percentile(l, 0.9),
+           percentile(l, 0.99), percentile(l, 1.0));
+  }
+
+  const auto &total = tracer.latencies.back();
+  printf("\n%-12s %8s\n", "TOTAL_MS", "COUNT");
+  size_t start = 0;
+  for (size_t b = 0; b <= std::size(HISTOGRAM_MS); b++) {
+    size_t end = b < std::size(HISTOGRAM_MS) ? std::lower_bound(total.begin(), total.end(), (uint64_t)(HISTOGRAM_MS[b] * 1e6)) - total.begin() : total.size();
+    std::string bucket = b < std::size(HISTOGRAM_MS) ? "< " + std::to_string((int)HISTOGRAM_MS[b]) : ">= " + std::to_string((int)HISTOGRAM_MS[b - 1]);
+    printf("%-12s %8zu %s\n", bucket.c_str(), end - start, std::string(total.empty() ? 0 : 50 * (end - start) / total.size(), '#').c_str());
+    start = end;
+  }
+  printf("\nunmatched: %" PRIu64 "\n", tracer.dropped);
+}
+
+int main(int argc, char** argv) {
+  signal(SIGINT, set_do_exit);
+  signal(SIGTERM, set_do_exit);
+
+  std::string chain_arg = DEFAULT_CHAIN;
+  double interval = 1.0;
+  bool once = false;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-1") {
+      once = true;
+    } else if (arg == "--chain" && i + 1 < argc) {
+      chain_arg = argv[++i];
+    } else {
+      interval = std::max(0.1, std::atof(argv[i]));
+    }
+  }
+
+  std::vector<std::string> names;
+  std::vector<int> chain;
+  for (size_t start = 0; start <= chain_arg.size();) {
+    size_t end = std::min(chain_arg.find(',', start), chain_arg.size());
+    names.push_back(chain_arg.substr(start, end - start));
+    chain.push_back(trace_service(names.back()));
+    if (chain.back() < 0) {
+      fprintf(stderr, "unknown service %s\n", names.back().c_str());
+      return 1;
+    }
+    start = end + 1;
+  }
+
+  trace_ring_t *ring = trace_ring_open(false);
+  if (ring == nullptr) {
+    fprintf(stderr, "no trace ring at %s, start the processes with CEREAL_TRACE=1\n", msgq_shm_path("cereal_trace").c_str());
+    return 1;
+  }
+
+  // Start with whatever is still in the ring, so a finished replay can be inspected too
+  uint64_t head = ring->head.load();
+  uint64_t pos = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+  ChainTracer tracer(chain);
+  uint64_t last_t = 0;
+  auto next_print = std::chrono::steady_clock::now() + std::chrono::milliseconds((int)(interval * 1000));
+  while (!do_exit) {
+    head = ring->head.load();
+    pos = std::max(pos, head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0);
+    for (; pos < head; pos++) {
+      trace_sample_t s;
+      int r = trace_read(ring, pos, &s);
+      if (r < 0) break;  // still being written, try again later
+      if (r > 0) continue;  // lapped
+
+      tracer.add(s);
+      last_t = s.t;
+    }
+
+    if (std::chrono::steady_clock::now() >= next_print) {
+      if (!once) {
+        printf("\033[2J\033[H");  // clear screen
+      }
+      print_latencies(tracer, names);
+      fflush(stdout);
+      if (once) break;
+
+      for (auto &l : tracer.latencies) l.clear();
+      tracer.dropped = 0;
+      tracer.prune(last_t);
+      next_print += std::chrono::milliseconds((int)(interval * 1000));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return 0;
+}
@@ -109,13 +109,26 @@ def build_header():
   h += "#ifndef __SERVICES_H\n"
   h += "#define __SERVICES_H\n"
   h += "struct service { char name[0x100]; int port; bool should_log; int frequency; int decimation; };\n"
-  h += "static struct service services[] = {\n"
+  h += "enum class ServiceId : int {\n"
+  for k in service_list:
+    h += "  %s,\n" % k
+  h += "};\n"
+  h += "static constexpr int NUM_SERVICES = %d;\n" % len(service_list)
+  h += "static constexpr struct service services[] = {\n"
   for k, v in service_list.items():
     should_log = "true" if v.should_log else "false"
     decimation = -1 if v.decimation is None else v.decimation
     h += '  { "%s", %d, %s, %d, %d },\n' % \
          (k, v.port, should_log, v.frequency, decimation)
   h += "};\n"
+  h += "static constexpr int get_service_index(const char *name) {\n"
+  h += "  for (int i = 0; i < NUM_SERVICES; i++) {\n"
+  h += "    const char *a = name, *b = services[i].name;\n"
+  h += "    while (*a && *a == *b) { a++; b++; }\n"
+  h += "    if (*a == *b) return i;\n"
+  h += "  }\n"
+  h += "  return -1;\n"
+  h += "}\n"
   h += "#endif\n"
   return h
 
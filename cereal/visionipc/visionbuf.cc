@@ -1,3 +1,7 @@
+#include <assert.h>
+#include <time.h>
+#include <sys/mman.h>
+
 #include "cereal/visionipc/visionbuf.h"
 
 #define ALIGN(x, align) (((x) + (align)-1) & ~((align)-1))
@@ -27,9 +31,94 @@ void VisionBuf::init_yuv(size_t init_width, size_t init_height, size_t init_stri
 
 
 uint64_t VisionBuf::get_frame_id() {
-  return *frame_id;
+  return shared->frame_id;
 }
 
 void VisionBuf::set_frame_id(uint64_t id) {
-  *frame_id = id;
+  shared->frame_id = id;
+}
+
+static uint64_t lease_time() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+bool VisionBuf::acquire_lease() {
+  if (lease_slot >= 0) return true;
+  shared->reads++;
+
+  // Take a free slot, or one left behind by a client that didn't release it
+  uint64_t t = lease_time();
+  for (int i = 0; i < VISIONBUF_LEASE_SLOTS; i++) {
+    uint64_t lease = shared->leases[i].load();
+    if ((lease == 0 || t - lease > VISIONBUF_LEASE_TIMEOUT_NS) && shared->leases[i].compare_exchange_strong(lease, t)) {
+      lease_slot = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+void VisionBuf::release_lease() {
+  if (lease_slot < 0) return;
+  shared->leases[lease_slot].store(0);
+  lease_slot = -1;
+}
+
+bool VisionBuf::is_leased() {
+  uint64_t t = lease_time();
+  for (int i = 0; i < VISIONBUF_LEASE_SLOTS; i++) {
+    uint64_t lease = shared->leases[i].load();
+    if (lease != 0 && t - lease <= VISIONBUF_LEASE_TIMEOUT_NS) return true;
+  }
+  return false;
+}
+
+void VisionBuf::touch() {
+  shared->last_recv.store(lease_time(), std::memory_order_relaxed);
+}
+
+bool VisionBuf::touched_within(uint64_t ns) {
+  uint64_t t = shared->last_recv.load(std::memory_order_relaxed);
+  return t != 0 && lease_time() - t <= ns;
+}
+
+void VisionBuf::populate() {
+  if (populated) return;
+  populated = true;
+
+  // Clients often only ever get some of the buffers, so they aren't prefaulted
+  // on connect. Populating one on its first recv costs a single syscall instead
+  // of a page fault per 4k of the frame
+#if defined(MADV_POPULATE_WRITE)
+  if (madvise(addr, mmap_len, MADV_POPULATE_WRITE) == 0) return;
+#endif
+#ifndef __APPLE__
+  madvise(addr, mmap_len, MADV_WILLNEED);
+#endif
+}
+
+void visionbuf_scale_yuv(VisionBuf *src, VisionBuf *dst) {
+  assert(!src->rgb && !dst->rgb);
+
+  for (size_t y = 0; y < dst->height; y++) {
+    const uint8_t *src_row = src->y + (y * src->height / dst->height) * src->stride;
+    uint8_t *dst_row = dst->y + y * dst->stride;
+    for (size_t x = 0; x < dst->width; x++) {
+      dst_row[x] = src_row[x * src->width / dst->width];
+    }
+  }
+
+  // Interleaved uv pairs at half resolution
+  size_t src_uv_width = src->width / 2, dst_uv_width = dst->width / 2;
+  for (size_t y = 0; y < dst->height / 2; y++) {
+    const uint8_t *src_row = src->uv + (y * src->height / dst->height) * src->stride;
+    uint8_t *dst_row = dst->uv + y * dst->stride;
+    for (size_t x = 0; x < dst_uv_width; x++) {
+      size_t sx = x * src_uv_width / dst_uv_width;
+      dst_row[2 * x] = src_row[2 * sx];
+      dst_row[2 * x + 1] = src_row[2 * sx + 1];
+    }
+  }
 }
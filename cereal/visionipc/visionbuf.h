@@ -1,5 +1,7 @@
 #pragma once
 
+#include <atomic>
+
 #include "cereal/visionipc/visionipc.h"
 
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS
@@ -12,21 +14,40 @@
 #define VISIONBUF_SYNC_FROM_DEVICE 0
 #define VISIONBUF_SYNC_TO_DEVICE 1
 
+#define VISIONBUF_LEASE_SLOTS 8
+#define VISIONBUF_LEASE_TIMEOUT_NS 1000000000ULL // leases older than this are from crashed or stuck clients
+
 enum VisionStreamType {
   VISION_STREAM_ROAD,
   VISION_STREAM_DRIVER,
   VISION_STREAM_WIDE_ROAD,
 
   VISION_STREAM_MAP,
+
+  // Derived streams, see VisionIpcServer::create_derived_buffers
+  VISION_STREAM_ROAD_QCAM,
   VISION_STREAM_MAX,
 };
 
+// Shared state after the image data of every buffer
+struct VisionBufShared {
+  uint64_t frame_id;
+  // Bumped by the server every time it hands out the buffer for writing
+  std::atomic<uint64_t> generation;
+  // Acquire time (CLOCK_MONOTONIC ns) of the clients reading the buffer, 0 if free
+  std::atomic<uint64_t> leases[VISIONBUF_LEASE_SLOTS];
+  // Last time a client of the stream asked for a frame, only kept on the first buffer of a stream
+  std::atomic<uint64_t> last_recv;
+  // Times a client leased the buffer
+  std::atomic<uint64_t> reads;
+};
+
 class VisionBuf {
  public:
   size_t len = 0;
   size_t mmap_len = 0;
   void * addr = nullptr;
-  uint64_t *frame_id;
+  VisionBufShared *shared = nullptr;
   int fd = 0;
 
   bool rgb = false;
@@ -43,6 +64,8 @@ class VisionBuf {
   uint64_t server_id = 0;
   size_t idx = 0;
   VisionStreamType type;
+  int lease_slot = -1;
+  bool populated = false;
 
   // OpenCL
   cl_mem buf_cl = nullptr;
@@ -61,6 +84,21 @@ class VisionBuf {
 
   void set_frame_id(uint64_t id);
   uint64_t get_frame_id();
+
+  bool acquire_lease();
+  void release_lease();
+  bool is_leased();
+  void touch();
+  bool touched_within(uint64_t ns);
+  // Faults in the page tables of an imported buffer, once
+  void populate();
 };
 
+// The shared state starts at the first cache line after the data
+inline size_t visionbuf_shared_offset(size_t data_len) {
+  return (data_len + 63) & ~(size_t)63;
+}
+
 void visionbuf_compute_aligned_width_and_height(int width, int height, int *aligned_w, int *aligned_h);
+// Nearest neighbour scale of a yuv buffer into another of any size
+void visionbuf_scale_yuv(VisionBuf *src, VisionBuf *dst);
@@ -1,42 +1,87 @@
 #include "cereal/visionipc/visionbuf.h"
 
 #include <atomic>
+#include <iostream>
+#include <string>
 #include <stdio.h>
 #include <fcntl.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 
 std::atomic<int> offset = 0;
 
-static void *malloc_with_fd(size_t len, int *fd) {
-  char full_path[0x100];
+#ifndef __APPLE__
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+// VISIONBUF_HUGETLB=1 backs buffers with reserved huge pages (vm.nr_hugepages), falling back to regular pages
+const bool HUGETLB = (getenv("VISIONBUF_HUGETLB") != nullptr) && (std::string(getenv("VISIONBUF_HUGETLB")) == "1");
+#endif
 
+static int create_fd() {
 #ifdef __APPLE__
+  char full_path[0x100];
   snprintf(full_path, sizeof(full_path)-1, "/tmp/visionbuf_%d_%d", getpid(), offset++);
+  int fd = open(full_path, O_RDWR | O_CREAT, 0664);
+  unlink(full_path);
+  return fd;
 #else
-  snprintf(full_path, sizeof(full_path)-1, "/dev/shm/visionbuf_%d_%d", getpid(), offset++);
+  char name[0x100];
+  snprintf(name, sizeof(name)-1, "visionbuf_%d_%d", getpid(), offset++);
+  return memfd_create(name, MFD_CLOEXEC);
+#endif
+}
+
+static void *map_fd(int fd, size_t len) {
+  return mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+}
+
+// len is rounded up to what the memory is actually mapped with
+static void *malloc_with_fd(size_t *len, int *fd) {
+#ifndef __APPLE__
+  if (HUGETLB) {
+    char name[0x100];
+    snprintf(name, sizeof(name)-1, "visionbuf_%d_%d", getpid(), offset++);
+    size_t huge_len = (*len + HUGEPAGE_SIZE - 1) & ~(size_t)(HUGEPAGE_SIZE - 1);
+    *fd = memfd_create(name, MFD_CLOEXEC | MFD_HUGETLB);
+    if (*fd >= 0 && ftruncate(*fd, huge_len) == 0) {
+      void *addr = map_fd(*fd, huge_len);
+      if (addr != MAP_FAILED) {
+        *len = huge_len;
+        memset(addr, 0, *len);  // fault the pages in now instead of on the first frames
+        return addr;
+      }
+    }
+    if (*fd >= 0) close(*fd);
+    std::cout << "Warning, no huge pages available for visionbuf, using regular pages" << std::endl;
+  }
 #endif
 
-  *fd = open(full_path, O_RDWR | O_CREAT, 0664);
+  *fd = create_fd();
   assert(*fd >= 0);
 
-  unlink(full_path);
+  int err = ftruncate(*fd, *len);
+  assert(err == 0);
 
-  ftruncate(*fd, len);
-  void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+  void *addr = map_fd(*fd, *len);
   assert(addr != MAP_FAILED);
 
+#ifndef __APPLE__
+  // Only a hint, shmem THP depends on /sys/kernel/mm/transparent_hugepage/shmem_enabled
+  madvise(addr, *len, MADV_HUGEPAGE);
+#endif
+  memset(addr, 0, *len);  // fault the pages in now instead of on the first frames
   return addr;
 }
 
 void VisionBuf::allocate(size_t length) {
   this->len = length;
-  this->mmap_len = this->len + sizeof(uint64_t);
-  this->addr = malloc_with_fd(this->mmap_len, &this->fd);
-  this->frame_id = (uint64_t*)((uint8_t*)this->addr + this->len);
+  this->mmap_len = visionbuf_shared_offset(this->len) + sizeof(VisionBufShared);
+  this->addr = malloc_with_fd(&this->mmap_len, &this->fd);
+  this->shared = (VisionBufShared*)((uint8_t*)this->addr + visionbuf_shared_offset(this->len));
 }
 
 void VisionBuf::init_cl(cl_device_id device_id, cl_context ctx){
@@ -52,10 +97,12 @@ void VisionBuf::init_cl(cl_device_id device_id, cl_context ctx){
 
 void VisionBuf::import(){
   assert(this->fd >= 0);
-  this->addr = mmap(NULL, this->mmap_len, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+  // Pages are populated on the first recv of the buffer, see VisionBuf::populate
+  this->addr = map_fd(this->fd, this->mmap_len);
+  this->populated = false;
   assert(this->addr != MAP_FAILED);
 
-  this->frame_id = (uint64_t*)((uint8_t*)this->addr + this->len);
+  this->shared = (VisionBufShared*)((uint8_t*)this->addr + visionbuf_shared_offset(this->len));
 }
 
 
@@ -86,7 +133,7 @@ int VisionBuf::free() {
     if (err != 0) return err;
   }
 
-  err = munmap(this->addr, this->len);
+  err = munmap(this->addr, this->mmap_len);
   if (err != 0) return err;
 
   err = close(this->fd);
@@ -5,15 +5,45 @@
 
 constexpr int VISIONIPC_MAX_FDS = 128;
 
+#define VISIONIPC_META_VERSION 1
+
+enum VisionIpcMetaFlags : uint16_t {
+  VISIONIPC_META_HIGH_CONVERSION_GAIN = 1 << 0,
+};
+
+// Per frame metadata, so clients don't have to join the camera state messages by frame id.
+// The size is fixed. New fields go into the reserved space and bump the version,
+// clients check the version before reading a field. Version 0 means the server didn't fill it in.
+struct VisionIpcFrameMeta {
+  uint16_t version;
+  uint16_t flags;
+
+  // Exposure (version 1)
+  uint32_t integ_lines;
+  float gain;
+  float measured_grey_fraction;
+  float target_grey_fraction;
+  float processing_time;
+
+  // Region of the sensor the buffer shows, and the row major transform from buffer to sensor pixels (version 1)
+  int32_t crop_x, crop_y, crop_w, crop_h;
+  float transform[9];
+
+  uint8_t reserved[52];
+};
+static_assert(sizeof(VisionIpcFrameMeta) == 128, "VisionIpcFrameMeta layout is fixed");
+
 struct VisionIpcBufExtra {
   uint32_t frame_id;
   uint64_t timestamp_sof;
   uint64_t timestamp_eof;
   bool valid;
+  VisionIpcFrameMeta meta;
 };
 
 struct VisionIpcPacket {
   uint64_t server_id;
   size_t idx;
+  uint64_t generation;
   struct VisionIpcBufExtra extra;
 };
@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "cereal/visionipc/visionipc_server.h"
+#include "cereal/visionipc/visionipc_client.h"
+
+// Copy throughput (time spent in memcpy) and page faults of VisionIpcServer::send and VisionIpcClient::recv
+// for three 1928x1208 NV12 cameras. Run with VISIONBUF_HUGETLB=1 to compare huge pages.
+//
+// usage: visionipc_bench [frames]
+
+const size_t WIDTH = 1928;
+const size_t HEIGHT = 1208;
+const int NUM_BUFFERS = 8;
+const VisionStreamType STREAMS[] = {VISION_STREAM_ROAD, VISION_STREAM_WIDE_ROAD, VISION_STREAM_DRIVER};
+
+static uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t minor_faults() {
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return usage.ru_minflt + usage.ru_majflt;
+}
+
+struct BenchResult {
+  std::vector<uint64_t> latencies;
+  uint64_t faults = 0;
+  uint64_t bytes = 0;
+  uint64_t time = 0;
+};
+
+static double percentile(const std::vector<uint64_t> &sorted, double p) {
+  if (sorted.empty()) return 0;
+  return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))] * 1e-3;
+}
+
+static void print_result(const char *name, BenchResult &res) {
+  std::sort(res.latencies.begin(), res.latencies.end());
+  size_t frames = std::max((size_t)1, res.latencies.size());
+  printf("%-10s %8zu %8.2f %12.2f %9.2f %9.2f\n", name, res.latencies.size(), res.time ? (double)res.bytes / res.time : 0,
+         (double)res.faults / frames, percentile(res.latencies, 0.5), percentile(res.latencies, 0.99));
+}
+
+// Fills and sends frames for all cameras, like camerad
+static BenchResult run_server(VisionIpcServer &server, int frames) {
+  std::vector<uint8_t> frame(WIDTH * HEIGHT * 3 / 2);
+  for (size_t i = 0; i < frame.size(); i++) frame[i] = i;
+
+  BenchResult res;
+  res.latencies.reserve(frames * std::size(STREAMS));
+  uint64_t faults_start = minor_faults();
+  for (int i = 0; i < frames; i++) {
+    for (auto type : STREAMS) {
+      uint64_t t = now_ns();
+      VisionBuf *buf = server.get_buffer(type);
+      memcpy(buf->addr, frame.data(), frame.size());
+
+      VisionIpcBufExtra extra = {0};
+      extra.frame_id = i;
+      buf->set_frame_id(i);
+      server.send(buf, &extra, false);
+      uint64_t dt = now_ns() - t;
+      res.latencies.push_back(dt);
+      res.bytes += frame.size();
+      res.time += dt;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  res.faults = minor_faults() - faults_start;
+  return res;
+}
+
+// Receives and reads every frame, like a consumer touching the whole image
+static void run_client(VisionStreamType type, std::atomic<bool> &ready, std::atomic<bool> &done, BenchResult &res) {
+  VisionIpcClient client("camerad", type, false);
+  client.connect(true);
+  std::vector<uint8_t> frame(WIDTH * HEIGHT * 3 / 2);
+  ready = true;
+
+  uint64_t faults_start = minor_faults();
+  while (!done) {
+    VisionBuf *buf = client.recv(nullptr, 10);
+    if (buf == nullptr) continue;
+
+    uint64_t t = now_ns();
+    memcpy(frame.data(), buf->addr, std::min(frame.size(), buf->len));
+    uint64_t dt = now_ns() - t;
+    res.latencies.push_back(dt);
+    res.bytes += frame.size();
+    res.time += dt;
+  }
+  res.faults = minor_faults() - faults_start;
+}
+
+int main(int argc, char **argv) {
+  int frames = argc > 1 ? std::atoi(argv[1]) : 1000;
+
+  VisionIpcServer server("camerad");
+  for (auto type : STREAMS) {
+    server.create_buffers(type, NUM_BUFFERS, false, WIDTH, HEIGHT);
+  }
+  server.start_listener();
+
+  std::atomic<bool> done = false;
+  std::atomic<bool> ready[std::size(STREAMS)] = {};
+  BenchResult client_results[std::size(STREAMS)];
+  std::vector<std::thread> clients;
+  for (size_t i = 0; i < std::size(STREAMS); i++) {
+    clients.emplace_back(run_client, STREAMS[i], std::ref(ready[i]), std::ref(done), std::ref(client_results[i]));
+  }
+  for (auto &r : ready) {
+    while (!r) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  BenchResult server_result = run_server(server, frames);
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  done = true;
+  for (auto &t : clients) t.join();
+
+  printf("huge pages: %s\n", getenv("VISIONBUF_HUGETLB") ? getenv("VISIONBUF_HUGETLB") : "0");
+  printf("%-10s %8s %8s %12s %9s %9s\n", "STAGE", "FRAMES", "GB/S", "FAULTS/FRAME", "P50_US", "P99_US");
+  print_result("send", server_result);
+  const char *names[] = {"recv_road", "recv_wide", "recv_drv"};
+  for (size_t i = 0; i < std::size(STREAMS); i++) {
+    print_result(names[i], client_results[i]);
+  }
+  return 0;
+}
@@ -3,6 +3,7 @@
 #include <iostream>
 #include <thread>
 
+#include "cereal/messaging/trace.h"
 #include "cereal/visionipc/ipc.h"
 #include "cereal/visionipc/visionipc_client.h"
 #include "cereal/visionipc/visionipc_server.h"
@@ -36,6 +37,7 @@ VisionIpcClient::VisionIpcClient(std::string name, VisionStreamType type, bool c
 // Connect is not thread safe. Do not use the buffers while calling connect
 bool VisionIpcClient::connect(bool blocking){
   connected = false;
+  release();
 
   // Cleanup old buffers on reconnect
   for (size_t i = 0; i < num_buffers; i++){
@@ -82,6 +84,11 @@ bool VisionIpcClient::connect(bool blocking){
 }
 
 VisionBuf * VisionIpcClient::recv(VisionIpcBufExtra * extra, const int timeout_ms){
+  release();
+  if (num_buffers > 0) {
+    buffers[0].touch();  // keeps derived streams alive
+  }
+
   auto p = poller->poll(timeout_ms);
 
   if (!p.size()){
@@ -106,6 +113,19 @@ VisionBuf * VisionIpcClient::recv(VisionIpcBufExtra * extra, const int timeout_m
     return nullptr;
   }
 
+  // With all lease slots taken the frame is read unprotected, like before leases existed
+  if (buf->acquire_lease()) {
+    leased = buf;
+  }
+  if (buf->shared->generation.load() != packet->generation) {
+    overwritten++;
+    release();
+    delete r;
+    return nullptr;
+  }
+  trace_receive(TRACE_VISION_SERVICE + type, packet->extra.frame_id);
+  buf->populate();
+
   if (extra) {
     *extra = packet->extra;
   }
@@ -118,6 +138,13 @@ VisionBuf * VisionIpcClient::recv(VisionIpcBufExtra * extra, const int timeout_m
   return buf;
 }
 
+void VisionIpcClient::release(){
+  if (leased) {
+    leased->release_lease();
+    leased = nullptr;
+  }
+}
+
 std::set<VisionStreamType> VisionIpcClient::getAvailableStreams(const std::string &name, bool blocking) {
   int socket_fd = connect_to_vipc_server(name, blocking);
   if (socket_fd < 0) {
@@ -136,6 +163,8 @@ std::set<VisionStreamType> VisionIpcClient::getAvailableStreams(const std::strin
 }
 
 VisionIpcClient::~VisionIpcClient(){
+  release();
+
   for (size_t i = 0; i < num_buffers; i++){
     if (buffers[i].free() != 0) {
       LOGE("Failed to free buffer %zu", i);
@@ -18,6 +18,7 @@ private:
 
   cl_device_id device_id = nullptr;
   cl_context ctx = nullptr;
+  VisionBuf * leased = nullptr;
 
   void init_msgq(bool conflate);
 
@@ -26,9 +27,12 @@ public:
   VisionStreamType type;
   int num_buffers = 0;
   VisionBuf buffers[VISIONIPC_MAX_FDS];
+  uint64_t overwritten = 0; // frames dropped because the server reused the buffer before they were read
   VisionIpcClient(std::string name, VisionStreamType type, bool conflate, cl_device_id device_id=nullptr, cl_context ctx=nullptr);
   ~VisionIpcClient();
+  // The returned buffer is leased until the next call to recv or release, the server won't reuse it meanwhile
   VisionBuf * recv(VisionIpcBufExtra * extra=nullptr, const int timeout_ms=100);
+  void release();
   bool connect(bool blocking=true);
   bool is_connected() { return connected; }
   static std::set<VisionStreamType> getAvailableStreams(const std::string &name, bool blocking = true);
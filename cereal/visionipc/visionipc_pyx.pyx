@@ -5,7 +5,7 @@ import sys
 import numpy as np
 cimport numpy as cnp
 from cython.view cimport array
-from libc.string cimport memcpy
+from libc.string cimport memcpy, memset
 from libc.stdint cimport uint32_t, uint64_t
 from libcpp cimport bool
 from libcpp.string cimport string
@@ -26,6 +26,7 @@ cpdef enum VisionStreamType:
   VISION_STREAM_DRIVER
   VISION_STREAM_WIDE_ROAD
   VISION_STREAM_MAP
+  VISION_STREAM_ROAD_QCAM
 
 
 cdef class VisionBuf:
@@ -81,6 +82,7 @@ cdef class VisionIpcServer:
     buf.set_frame_id(frame_id)
 
     cdef VisionIpcBufExtra extra
+    memset(&extra, 0, sizeof(extra))
     extra.frame_id = frame_id
     extra.timestamp_sof = timestamp_sof
     extra.timestamp_eof = timestamp_eof
@@ -0,0 +1,260 @@
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cereal/visionipc/visionipc_server.h"
+#include "cereal/visionipc/visionipc_client.h"
+
+// Captures raw VisionIpc frames to a file and serves them again through a VisionIpcServer,
+// to benchmark consumers like modeld or encoderd without a replay and video decode.
+//
+// usage: visionipc_record record <file> [--name camerad] [--streams 0,1,2] [--frames n]
+//        visionipc_record play <file> [--name camerad] [--rate hz] [--ack [consumers]] [--loop]
+//   --rate: frame groups (frames with the same frame id) per second, 20 by default
+//   --ack:  send the next group as soon as every frame of the last one was read and released
+//           by the given number of consumers per stream, instead of at a fixed rate
+
+#define RECORD_MAGIC 0x52435056 // "VPCR"
+#define RECORD_VERSION 1
+#define ACK_TIMEOUT_MS 1000
+#define PLAY_BUFFERS 4
+
+// Followed by one RecordStream per stream, then the frames
+struct RecordHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_streams;
+  uint32_t extra_size; // sizeof(VisionIpcBufExtra) at record time
+};
+
+struct RecordStream {
+  uint32_t type;
+  uint32_t rgb;
+  uint64_t width;
+  uint64_t height;
+  uint64_t stride;
+  uint64_t uv_offset;
+  uint64_t len;
+};
+
+// Followed by the image without stride padding: height rows of the
+// y plane and height / 2 rows of the uv plane for yuv, height rows for rgb
+struct RecordFrame {
+  uint32_t stream;
+  VisionIpcBufExtra extra;
+};
+
+std::atomic<bool> do_exit = false;
+static void set_do_exit(int sig) {
+  do_exit = true;
+}
+
+static size_t row_size(const RecordStream &s) {
+  return s.rgb ? s.width * 3 : s.width;
+}
+
+static std::vector<std::pair<size_t, size_t>> image_rows(const RecordStream &s) {
+  // offset and length of every row that holds pixels
+  std::vector<std::pair<size_t, size_t>> rows;
+  for (size_t y = 0; y < s.height; y++) rows.push_back({y * s.stride, row_size(s)});
+  if (!s.rgb) {
+    for (size_t y = 0; y < s.height / 2; y++) rows.push_back({s.uv_offset + y * s.stride, s.width});
+  }
+  return rows;
+}
+
+static std::vector<int> parse_ints(const std::string &s) {
+  std::vector<int> r;
+  for (size_t start = 0; start < s.size();) {
+    size_t end = std::min(s.find(',', start), s.size());
+    r.push_back(std::atoi(s.substr(start, end - start).c_str()));
+    start = end + 1;
+  }
+  return r;
+}
+
+static int record(const char *path, const std::string &name, const std::vector<int> &types, uint64_t max_frames) {
+  std::vector<VisionIpcClient *> clients;
+  for (int type : types) {
+    clients.push_back(new VisionIpcClient(name, (VisionStreamType)type, false));
+    while (!do_exit && !clients.back()->connect(false)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+  }
+  if (do_exit) return 1;
+
+  FILE *f = fopen(path, "wb");
+  if (f == nullptr) {
+    fprintf(stderr, "could not open %s\n", path);
+    return 1;
+  }
+
+  RecordHeader header = {RECORD_MAGIC, RECORD_VERSION, (uint32_t)types.size(), sizeof(VisionIpcBufExtra)};
+  fwrite(&header, sizeof(header), 1, f);
+  std::vector<RecordStream> streams;
+  for (auto client : clients) {
+    VisionBuf &b = client->buffers[0];
+    streams.push_back({(uint32_t)client->type, b.rgb, b.width, b.height, b.stride, b.uv_offset, b.len});
+    fwrite(&streams.back(), sizeof(RecordStream), 1, f);
+  }
+
+  uint64_t frames = 0, bytes = 0;
+  while (!do_exit && (max_frames == 0 || frames < max_frames)) {
+    for (size_t i = 0; i < clients.size(); i++) {
+      RecordFrame frame = {(uint32_t)i};
+      VisionBuf *buf = clients[i]->recv(&frame.extra, 10);
+      if (buf == nullptr) continue;
+
+      fwrite(&frame, sizeof(frame), 1, f);
+      for (auto [offset, size] : image_rows(streams[i])) {
+        fwrite((uint8_t *)buf->addr + offset, 1, size, f);
+        bytes += size;
+      }
+      frames++;
+    }
+  }
+  fclose(f);
+  printf("recorded %" PRIu64 " frames, %.1f MB\n", frames, bytes / 1e6);
+
+  for (auto client : clients) delete client;
+  return 0;
+}
+
+// Waits until every buffer was read by the consumers and released again
+static bool wait_ack(const std::vector<std::pair<VisionBuf *, uint64_t>> &sent, int consumers) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ACK_TIMEOUT_MS);
+  for (auto &[buf, reads] : sent) {
+    while (buf->shared->reads.load() < reads + consumers || buf->is_leased()) {
+      if (do_exit || std::chrono::steady_clock::now() > deadline) return false;
+      std::this_thread::yield();
+    }
+  }
+  return true;
+}
+
+static int play(const char *path, const std::string &name, double rate, int ack_consumers, bool loop) {
+  FILE *f = fopen(path, "rb");
+  if (f == nullptr) {
+    fprintf(stderr, "could not open %s\n", path);
+    return 1;
+  }
+
+  RecordHeader header;
+  if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != RECORD_MAGIC || header.version != RECORD_VERSION ||
+      header.extra_size != sizeof(VisionIpcBufExtra)) {
+    fprintf(stderr, "%s is not a recording of this version\n", path);
+    return 1;
+  }
+
+  VisionIpcServer server(name);
+  std::vector<RecordStream> streams(header.num_streams);
+  for (auto &s : streams) {
+    if (fread(&s, sizeof(s), 1, f) != 1) {
+      fprintf(stderr, "%s is truncated\n", path);
+      return 1;
+    }
+    server.create_buffers_with_sizes((VisionStreamType)s.type, PLAY_BUFFERS, s.rgb, s.width, s.height, s.len, s.stride, s.uv_offset);
+  }
+  server.start_listener();
+  long frames_start = ftell(f);
+
+  uint64_t frames = 0, groups = 0, timeouts = 0;
+  auto start = std::chrono::steady_clock::now();
+  auto next_group = start;
+  std::vector<std::pair<VisionBuf *, uint64_t>> sent;
+  RecordFrame frame;
+  bool have_frame = fread(&frame, sizeof(frame), 1, f) == 1;
+  while (!do_exit && have_frame) {
+    // Frames of all cameras with the same frame id go out together
+    uint32_t frame_id = frame.extra.frame_id;
+    sent.clear();
+    while (have_frame && frame.extra.frame_id == frame_id) {
+      if (frame.stream >= streams.size()) {
+        fprintf(stderr, "%s is corrupt\n", path);
+        return 1;
+      }
+      const RecordStream &s = streams[frame.stream];
+      VisionBuf *buf = server.get_buffer((VisionStreamType)s.type);
+      for (auto [offset, size] : image_rows(s)) {
+        if (fread((uint8_t *)buf->addr + offset, 1, size, f) != size) {
+          have_frame = false;
+          break;
+        }
+      }
+      if (!have_frame) break;
+
+      buf->set_frame_id(frame.extra.frame_id);
+      sent.push_back({buf, buf->shared->reads.load()});
+      server.send(buf, &frame.extra, false);
+      frames++;
+
+      have_frame = fread(&frame, sizeof(frame), 1, f) == 1;
+      if (!have_frame && loop && !do_exit) {
+        fseek(f, frames_start, SEEK_SET);
+        have_frame = fread(&frame, sizeof(frame), 1, f) == 1;
+      }
+    }
+    groups++;
+
+    if (ack_consumers > 0) {
+      if (!wait_ack(sent, ack_consumers)) timeouts++;
+    } else {
+      next_group += std::chrono::microseconds((int64_t)(1e6 / rate));
+      std::this_thread::sleep_until(next_group);
+    }
+  }
+  fclose(f);
+
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("played %" PRIu64 " frames in %" PRIu64 " groups, %.2f s, %.1f groups/s", frames, groups, elapsed, groups / elapsed);
+  if (ack_consumers > 0) printf(", %" PRIu64 " ack timeouts", timeouts);
+  printf("\n");
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  signal(SIGINT, set_do_exit);
+  signal(SIGTERM, set_do_exit);
+
+  if (argc < 3 || (std::string(argv[1]) != "record" && std::string(argv[1]) != "play")) {
+    fprintf(stderr, "usage: %s record <file> [--name camerad] [--streams 0,1,2] [--frames n]\n", argv[0]);
+    fprintf(stderr, "       %s play <file> [--name camerad] [--rate hz] [--ack [consumers]] [--loop]\n", argv[0]);
+    return 1;
+  }
+
+  std::string name = "camerad";
+  std::vector<int> types = {VISION_STREAM_ROAD, VISION_STREAM_WIDE_ROAD, VISION_STREAM_DRIVER};
+  uint64_t max_frames = 0;
+  double rate = 20;
+  int ack_consumers = 0;
+  bool loop = false;
+  for (int i = 3; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--name" && i + 1 < argc) {
+      name = argv[++i];
+    } else if (arg == "--streams" && i + 1 < argc) {
+      types = parse_ints(argv[++i]);
+    } else if (arg == "--frames" && i + 1 < argc) {
+      max_frames = std::atoll(argv[++i]);
+    } else if (arg == "--rate" && i + 1 < argc) {
+      rate = std::max(0.1, std::atof(argv[++i]));
+    } else if (arg == "--ack") {
+      ack_consumers = (i + 1 < argc && argv[i + 1][0] != '-') ? std::max(1, std::atoi(argv[++i])) : 1;
+    } else if (arg == "--loop") {
+      loop = true;
+    }
+  }
+
+  if (std::string(argv[1]) == "record") {
+    return record(argv[2], name, types, max_frames);
+  }
+  return play(argv[2], name, rate, ack_consumers, loop);
+}
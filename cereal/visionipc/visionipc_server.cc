@@ -9,6 +9,7 @@
 #include <unistd.h>
 
 #include "cereal/messaging/messaging.h"
+#include "cereal/messaging/trace.h"
 #include "cereal/visionipc/ipc.h"
 #include "cereal/visionipc/visionipc_server.h"
 #include "cereal/logger/logger.h"
@@ -68,6 +69,7 @@ void VisionIpcServer::create_buffers_with_sizes(VisionStreamType type, size_t nu
   }
 
   cur_idx[type] = 0;
+  stats[type] = {};
 
   // Create msgq publisher for each of the `name` + type combos
   // TODO: compute port number directly if using zmq
@@ -75,6 +77,16 @@ void VisionIpcServer::create_buffers_with_sizes(VisionStreamType type, size_t nu
 }
 
 
+void VisionIpcServer::create_derived_buffers(VisionStreamType type, VisionStreamType source, size_t num_buffers, size_t width, size_t height, VisionBufConverter convert) {
+  assert(buffers.count(source));
+  create_buffers(type, num_buffers, buffers[source][0]->rgb, width, height);
+  derived[source].push_back({type, convert});
+
+  if (!derived_thread.joinable()) {
+    derived_thread = std::thread(&VisionIpcServer::derived_worker, this);
+  }
+}
+
 void VisionIpcServer::start_listener(){
   listener_thread = std::thread(&VisionIpcServer::listener, this);
 }
@@ -166,18 +178,36 @@ void VisionIpcServer::listener(){
 
 
 VisionBuf * VisionIpcServer::get_buffer(VisionStreamType type){
-  // Do we want to keep track if the buffer has been sent out yet and warn user?
   assert(buffers.count(type));
-  auto b = buffers[type];
-  return b[cur_idx[type]++ % b.size()];
-}
+  auto &b = buffers[type];
 
-void VisionIpcServer::send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync){
-  if (sync) {
-    if (buf->sync(VISIONBUF_SYNC_FROM_DEVICE) != 0) {
-      LOGE("Failed to sync buffer");
+  // Round robin, passing over the buffers clients are still reading
+  for (size_t i = 0; i < b.size(); i++) {
+    VisionBuf *buf = b[cur_idx[type]++ % b.size()];
+
+    // Bump the generation before looking at the leases: a client leasing the buffer
+    // concurrently either shows up here or sees the new generation and drops the frame
+    uint64_t generation = buf->shared->generation.fetch_add(1);
+    if (!buf->is_leased()) {
+      return buf;
     }
+    buf->shared->generation.store(generation);
+    stats[type].skipped_leased++;
   }
+
+  // Everything is leased, clients reading the oldest buffer will drop their frame
+  stats[type].overwritten_leased++;
+  VisionBuf *buf = b[cur_idx[type]++ % b.size()];
+  buf->shared->generation++;
+  return buf;
+}
+
+VisionIpcServerStats VisionIpcServer::get_stats(VisionStreamType type){
+  assert(stats.count(type));
+  return stats[type];
+}
+
+void VisionIpcServer::publish(VisionBuf * buf, VisionIpcBufExtra * extra){
   assert(buffers.count(buf->type));
   assert(buf->idx < buffers[buf->type].size());
 
@@ -185,13 +215,103 @@ void VisionIpcServer::send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync
   VisionIpcPacket packet = {0};
   packet.server_id = server_id;
   packet.idx = buf->idx;
+  packet.generation = buf->shared->generation.load();
   packet.extra = *extra;
 
+  trace_publish(TRACE_VISION_SERVICE + buf->type, extra->frame_id);
   sockets[buf->type]->send((char*)&packet, sizeof(packet));
+  stats[buf->type].sent++;
+}
+
+void VisionIpcServer::send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync){
+  if (sync) {
+    if (buf->sync(VISIONBUF_SYNC_FROM_DEVICE) != 0) {
+      LOGE("Failed to sync buffer");
+    }
+  }
+  publish(buf, extra);
+
+  auto it = derived.find(buf->type);
+  if (it == derived.end()) return;
+
+  // Clients touch the first buffer of their stream on every recv
+  bool subscribed = false;
+  for (auto &[type, convert] : it->second) {
+    subscribed |= buffers[type][0]->touched_within(VISIONIPC_DERIVED_IDLE_NS);
+  }
+  if (!subscribed) return;
+
+  {
+    std::lock_guard<std::mutex> lk(derived_lock);
+    auto pending = derived_pending.find(buf->type);
+    if (pending != derived_pending.end() && pending->second.src != buf) {
+      pending->second.src->release_lease();
+    }
+
+    // The lease keeps get_buffer from handing out the source until it is converted
+    if (!buf->acquire_lease()) {
+      derived_pending.erase(buf->type);
+      return;
+    }
+    derived_pending[buf->type] = {buf, buf->shared->generation.load(), buf->get_frame_id(), *extra};
+  }
+  derived_cv.notify_one();
+}
+
+void VisionIpcServer::derived_worker(){
+  std::unique_lock<std::mutex> lk(derived_lock);
+  while (true) {
+    derived_cv.wait(lk, [&]() { return should_exit || !derived_pending.empty(); });
+    if (should_exit) break;
+
+    DerivedJob job = derived_pending.begin()->second;
+    derived_pending.erase(derived_pending.begin());
+    lk.unlock();
+
+    for (auto &[type, convert] : derived[job.src->type]) {
+      if (!buffers[type][0]->touched_within(VISIONIPC_DERIVED_IDLE_NS)) continue;
+
+      VisionBuf *derived_buf = get_buffer(type);
+      convert(job.src, derived_buf);
+
+      // Everything was leased and the source got handed out again while converting
+      if (job.src->shared->generation.load() != job.generation) break;
+
+      // The derived buffer covers the whole source buffer, scale the columns of the transform to match
+      VisionIpcBufExtra derived_extra = job.extra;
+      if (job.extra.meta.version >= 1) {
+        float sx = (float)job.src->width / derived_buf->width, sy = (float)job.src->height / derived_buf->height;
+        for (int i = 0; i < 3; i++) {
+          derived_extra.meta.transform[i * 3 + 0] *= sx;
+          derived_extra.meta.transform[i * 3 + 1] *= sy;
+        }
+      }
+
+      // Written by the CPU, flush it for clients reading it from the device
+      derived_buf->set_frame_id(job.frame_id);
+      if (derived_buf->sync(VISIONBUF_SYNC_TO_DEVICE) != 0) {
+        LOGE("Failed to sync buffer");
+      }
+      publish(derived_buf, &derived_extra);
+    }
+
+    lk.lock();
+    job.src->release_lease();
+  }
+
+  for (auto &[type, job] : derived_pending) {
+    job.src->release_lease();
+  }
+  derived_pending.clear();
 }
 
 VisionIpcServer::~VisionIpcServer(){
-  should_exit = true;
+  {
+    std::lock_guard<std::mutex> lk(derived_lock);
+    should_exit = true;
+  }
+  derived_cv.notify_one();
+  if (derived_thread.joinable()) derived_thread.join();
   listener_thread.join();
 
   // VisionBuf cleanup
@@ -4,13 +4,27 @@
 #include <thread>
 #include <atomic>
 #include <map>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 
 #include "cereal/messaging/messaging.h"
 #include "cereal/visionipc/visionipc.h"
 #include "cereal/visionipc/visionbuf.h"
 
+#define VISIONIPC_DERIVED_IDLE_NS 1000000000ULL // derived streams stop being produced this long after their last client went away
+
 std::string get_endpoint_name(std::string name, VisionStreamType type);
 
+// Fills dst from src, for derived streams
+typedef std::function<void(VisionBuf *src, VisionBuf *dst)> VisionBufConverter;
+
+struct VisionIpcServerStats {
+  uint64_t sent = 0;
+  uint64_t skipped_leased = 0; // buffers get_buffer passed over because a client was reading them
+  uint64_t overwritten_leased = 0; // all buffers were leased, so one was handed out anyway
+};
+
 class VisionIpcServer {
  private:
   cl_device_id device_id = nullptr;
@@ -23,20 +37,42 @@ class VisionIpcServer {
 
   std::map<VisionStreamType, std::atomic<size_t> > cur_idx;
   std::map<VisionStreamType, std::vector<VisionBuf*> > buffers;
+  std::map<VisionStreamType, VisionIpcServerStats> stats;
+  std::map<VisionStreamType, std::vector<std::pair<VisionStreamType, VisionBufConverter> > > derived;
+
+  // Derived streams are converted on their own thread, off the publish path of the source
+  struct DerivedJob {
+    VisionBuf *src;
+    uint64_t generation;
+    uint64_t frame_id;
+    VisionIpcBufExtra extra;
+  };
+  std::thread derived_thread;
+  std::mutex derived_lock;
+  std::condition_variable derived_cv;
+  std::map<VisionStreamType, DerivedJob> derived_pending; // latest frame per source not converted yet
 
   Context * msg_ctx;
   std::map<VisionStreamType, PubSocket*> sockets;
 
   void listener(void);
+  void derived_worker(void);
+  void publish(VisionBuf * buf, VisionIpcBufExtra * extra);
 
  public:
   VisionIpcServer(std::string name, cl_device_id device_id=nullptr, cl_context ctx=nullptr);
   ~VisionIpcServer();
 
   VisionBuf * get_buffer(VisionStreamType type);
+  VisionIpcServerStats get_stats(VisionStreamType type);
 
   void create_buffers(VisionStreamType type, size_t num_buffers, bool rgb, size_t width, size_t height);
   void create_buffers_with_sizes(VisionStreamType type, size_t num_buffers, bool rgb, size_t width, size_t height, size_t size, size_t stride, size_t uv_offset);
+  // A stream computed from every frame sent on source, only while it has clients. Opt-in per
+  // server, nothing is created by default. Frames are converted on a worker thread, if it
+  // falls behind only the latest source frame is converted
+  void create_derived_buffers(VisionStreamType type, VisionStreamType source, size_t num_buffers, size_t width, size_t height,
+                              VisionBufConverter convert = visionbuf_scale_yuv);
   void send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync=true);
   void start_listener();
 };
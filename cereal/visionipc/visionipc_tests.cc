@@ -146,3 +146,125 @@ TEST_CASE("Test conflate"){
   recv_buf = client.recv(&extra_recv);
   REQUIRE(recv_buf == nullptr);
 }
+
+TEST_CASE("Leased buffers are skipped"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_ROAD, 2, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_ROAD, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionBuf * buf = server.get_buffer(VISION_STREAM_ROAD);
+  VisionIpcBufExtra extra = {0};
+  extra.frame_id = 1;
+  server.send(buf, &extra);
+
+  VisionBuf * recv_buf = client.recv();
+  REQUIRE(recv_buf != nullptr);
+  REQUIRE(recv_buf->idx == buf->idx);
+
+  // The leased buffer is passed over until the client is done with it
+  REQUIRE(server.get_buffer(VISION_STREAM_ROAD)->idx != buf->idx);
+  REQUIRE(server.get_buffer(VISION_STREAM_ROAD)->idx != buf->idx);
+  REQUIRE(server.get_stats(VISION_STREAM_ROAD).skipped_leased == 1);
+
+  client.release();
+  REQUIRE(server.get_buffer(VISION_STREAM_ROAD)->idx == buf->idx);
+  REQUIRE(server.get_stats(VISION_STREAM_ROAD).overwritten_leased == 0);
+}
+
+TEST_CASE("Reused buffers are dropped"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_ROAD, 1, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_ROAD, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionIpcBufExtra extra = {0};
+  server.send(server.get_buffer(VISION_STREAM_ROAD), &extra);
+
+  // The frame is being overwritten before the client got to it
+  server.get_buffer(VISION_STREAM_ROAD);
+  REQUIRE(client.recv() == nullptr);
+  REQUIRE(client.overwritten == 1);
+}
+
+TEST_CASE("Derived streams"){
+  size_t width = 100, height = 60;
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_ROAD, 2, false, width, height);
+  server.create_derived_buffers(VISION_STREAM_ROAD_QCAM, VISION_STREAM_ROAD, 2, width / 2, height / 2);
+  server.start_listener();
+
+  // Synthetic frame, every pixel set to its column
+  auto send_frame = [&](uint32_t frame_id) {
+    VisionBuf * buf = server.get_buffer(VISION_STREAM_ROAD);
+    for (size_t y = 0; y < height * 3 / 2; y++) {
+      for (size_t x = 0; x < width; x++) buf->y[y * buf->stride + x] = x;
+    }
+    VisionIpcBufExtra extra = {0};
+    extra.frame_id = frame_id;
+    buf->set_frame_id(frame_id);
+    server.send(buf, &extra);
+  };
+
+  // Nothing is computed without clients
+  send_frame(1);
+  REQUIRE(server.get_stats(VISION_STREAM_ROAD_QCAM).sent == 0);
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_ROAD_QCAM, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+  REQUIRE(client.recv(nullptr, 0) == nullptr);
+
+  // Converted on the server's worker thread, after the source frame was sent
+  send_frame(2);
+  VisionIpcBufExtra extra_recv = {0};
+  VisionBuf * recv_buf = client.recv(&extra_recv);
+  REQUIRE(recv_buf != nullptr);
+  REQUIRE(server.get_stats(VISION_STREAM_ROAD_QCAM).sent == 1);
+  REQUIRE(extra_recv.frame_id == 2);
+  REQUIRE(recv_buf->get_frame_id() == 2);
+  REQUIRE(recv_buf->width == width / 2);
+  REQUIRE(recv_buf->y[recv_buf->stride + 10] == 20);
+  REQUIRE(recv_buf->uv[10] == 20);
+  REQUIRE(recv_buf->uv[11] == 21);
+}
+
+TEST_CASE("Frame metadata"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_ROAD, 1, false, 100, 60);
+  server.create_derived_buffers(VISION_STREAM_ROAD_QCAM, VISION_STREAM_ROAD, 1, 50, 30);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_ROAD, false);
+  VisionIpcClient client_qcam = VisionIpcClient("camerad", VISION_STREAM_ROAD_QCAM, false);
+  REQUIRE(client.connect());
+  REQUIRE(client_qcam.connect());
+  zmq_sleep();
+  client_qcam.recv(nullptr, 0);
+
+  VisionIpcBufExtra extra = {0};
+  extra.meta.version = VISIONIPC_META_VERSION;
+  extra.meta.integ_lines = 1000;
+  extra.meta.gain = 2.5;
+  extra.meta.transform[0] = extra.meta.transform[4] = extra.meta.transform[8] = 1.0;
+  server.send(server.get_buffer(VISION_STREAM_ROAD), &extra);
+
+  VisionIpcBufExtra extra_recv = {0};
+  REQUIRE(client.recv(&extra_recv) != nullptr);
+  REQUIRE(extra_recv.meta.version == VISIONIPC_META_VERSION);
+  REQUIRE(extra_recv.meta.integ_lines == 1000);
+  REQUIRE(extra_recv.meta.gain == 2.5);
+
+  // Derived buffers map back onto the sensor through the same transform
+  REQUIRE(client_qcam.recv(&extra_recv) != nullptr);
+  REQUIRE(extra_recv.meta.integ_lines == 1000);
+  REQUIRE(extra_recv.meta.transform[0] == 2.0);
+  REQUIRE(extra_recv.meta.transform[4] == 2.0);
+  REQUIRE(extra_recv.meta.transform[8] == 1.0);
+}
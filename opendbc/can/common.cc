@@ -1,7 +1,7 @@
 #include "opendbc/can/common.h"
 
 
-unsigned int honda_checksum(uint32_t address, const Signal &sig, const std::vector<uint8_t> &d) {
+unsigned int honda_checksum(uint32_t address, const Signal &sig, DataView d) {
   int s = 0;
   bool extended = address > 0x7FF;
   while (address) { s += (address & 0xF); address >>= 4; }
@@ -16,7 +16,7 @@ unsigned int honda_checksum(uint32_t address, const Signal &sig, const std::vect
   return s & 0xF;
 }
 
-unsigned int toyota_checksum(uint32_t address, const Signal &sig, const std::vector<uint8_t> &d) {
+unsigned int toyota_checksum(uint32_t address, const Signal &sig, DataView d) {
   unsigned int s = d.size();
   while (address) { s += address & 0xFF; address >>= 8; }
   for (int i = 0; i < d.size() - 1; i++) { s += d[i]; }
@@ -24,7 +24,7 @@ unsigned int toyota_checksum(uint32_t address, const Signal &sig, const std::vec
   return s & 0xFF;
 }
 
-unsigned int subaru_checksum(uint32_t address, const Signal &sig, const std::vector<uint8_t> &d) {
+unsigned int subaru_checksum(uint32_t address, const Signal &sig, DataView d) {
   unsigned int s = 0;
   while (address) { s += address & 0xFF; address >>= 8; }
 
@@ -34,7 +34,7 @@ unsigned int subaru_checksum(uint32_t address, const Signal &sig, const std::vec
   return s & 0xFF;
 }
 
-unsigned int chrysler_checksum(uint32_t address, const Signal &sig, const std::vector<uint8_t> &d) {
+unsigned int chrysler_checksum(uint32_t address, const Signal &sig, DataView d) {
   // jeep chrysler canbus checksum from http://illmatics.com/Remote%20Car%20Hacking.pdf
   uint8_t checksum = 0xFF;
   for (int j = 0; j < (d.size() - 1); j++) {
@@ -108,7 +108,7 @@ void init_crc_lookup_tables() {
   gen_crc_lookup_table_16(0x1021, crc16_lut_xmodem);    // CRC-16 XMODEM for HKG CAN FD
 }
 
-unsigned int volkswagen_mqb_checksum(uint32_t address, const Signal &sig, const std::vector<uint8_t> &d) {
+unsigned int volkswagen_mqb_checksum(uint32_t address, const Signal &sig, DataView d) {
   // Volkswagen uses standard CRC8 8H2F/AUTOSAR, but they compute it with
   // a magic variable padding byte tacked onto the end of the payload.
   // https://www.autosar.org/fileadmin/user_upload/standards/classic/4-3/AUTOSAR_SWS_CRCLibrary.pdf
@@ -189,7 +189,7 @@ unsigned int volkswagen_mqb_checksum(uint32_t address, const Signal &sig, const
   return crc ^ 0xFF; // Return after standard final XOR for CRC8 8H2F/AUTOSAR
 }
 
-unsigned int xor_checksum(uint32_t address, const Signal &sig, const std::vector<uint8_t> &d) {
+unsigned int xor_checksum(uint32_t address, const Signal &sig, DataView d) {
   uint8_t checksum = 0;
   int checksum_byte = sig.start_bit / 8;
 
@@ -203,7 +203,7 @@ unsigned int xor_checksum(uint32_t address, const Signal &sig, const std::vector
   return checksum;
 }
 
-unsigned int pedal_checksum(uint32_t address, const Signal &sig, const std::vector<uint8_t> &d) {
+unsigned int pedal_checksum(uint32_t address, const Signal &sig, DataView d) {
   uint8_t crc = 0xFF;
   uint8_t poly = 0xD5; // standard crc8
 
@@ -221,7 +221,7 @@ unsigned int pedal_checksum(uint32_t address, const Signal &sig, const std::vect
   return crc;
 }
 
-unsigned int hkg_can_fd_checksum(uint32_t address, const Signal &sig, const std::vector<uint8_t> &d) {
+unsigned int hkg_can_fd_checksum(uint32_t address, const Signal &sig, DataView d) {
   uint16_t crc = 0;
 
   for (int i = 2; i < d.size(); i++) {
@@ -244,3 +244,43 @@ unsigned int hkg_can_fd_checksum(uint32_t address, const Signal &sig, const std:
 
   return crc;
 }
+
+int64_t get_raw_value(DataView msg, const Signal &sig) {
+  int64_t ret = 0;
+
+  int i = sig.msb / 8;
+  int bits = sig.size;
+  while (i >= 0 && i < msg.size() && bits > 0) {
+    int lsb = (int)(sig.lsb / 8) == i ? sig.lsb : i*8;
+    int msb = (int)(sig.msb / 8) == i ? sig.msb : (i+1)*8 - 1;
+    int size = msb - lsb + 1;
+
+    uint64_t d = (msg[i] >> (lsb - (i*8))) & ((1ULL << size) - 1);
+    ret |= d << (bits - size);
+
+    bits -= size;
+    i = sig.is_little_endian ? i-1 : i+1;
+  }
+  return ret;
+}
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "signal extraction assumes a little endian host");
+
+SignalExtract compile_signal(const Signal &sig) {
+  SignalExtract e = {};
+  e.little_endian = sig.is_little_endian;
+  e.mask = sig.size >= 64 ? ~0ULL : (1ULL << sig.size) - 1;
+  e.sign_bit = sig.is_signed ? 1ULL << (sig.size - 1) : 0;
+
+  // little endian bits go up from the lsb byte, big endian bits go down from the msb byte
+  int first_byte = sig.is_little_endian ? sig.lsb / 8 : sig.msb / 8;
+  int last_byte = sig.is_little_endian ? sig.msb / 8 : sig.lsb / 8;
+  e.generic = last_byte - first_byte >= 8;
+  e.byte = first_byte;
+  e.shift = sig.is_little_endian ? sig.lsb % 8 : (7 - (last_byte - first_byte)) * 8 + sig.lsb % 8;
+
+  // get_raw_value starts reading at the msb byte, so a little endian signal whose
+  // msb byte is missing reads as 0, while missing bytes of big endian signals read as zeros
+  e.min_size = sig.is_little_endian ? sig.msb / 8 + 1 : 0;
+  return e;
+}
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <array>
 #include <map>
+#include <queue>
 #include <string>
 #include <utility>
 #include <unordered_map>
@@ -14,6 +16,7 @@
 #endif
 
 #include "opendbc/can/common_dbc.h"
+#include "opendbc/can/generated_dbc.h"
 
 #define INFO printf
 #define WARN printf
@@ -22,18 +25,34 @@
 
 #define MAX_BAD_COUNTER 5
 #define CAN_INVALID_CNT 5
+#define MAX_SIGNAL_HISTORY 64  // values kept per signal between queries
 
 void init_crc_lookup_tables();
 
 // Car specific functions
-unsigned int honda_checksum(uint32_t address, const Signal &sig, const std::vector<uint8_t> &d);
-unsigned int toyota_checksum(uint32_t address, const Signal &sig, const std::vector<uint8_t> &d);
-unsigned int subaru_checksum(uint32_t address, const Signal &sig, const std::vector<uint8_t> &d);
-unsigned int chrysler_checksum(uint32_t address, const Signal &sig, const std::vector<uint8_t> &d);
-unsigned int volkswagen_mqb_checksum(uint32_t address, const Signal &sig, const std::vector<uint8_t> &d);
-unsigned int xor_checksum(uint32_t address, const Signal &sig, const std::vector<uint8_t> &d);
-unsigned int hkg_can_fd_checksum(uint32_t address, const Signal &sig, const std::vector<uint8_t> &d);
-unsigned int pedal_checksum(uint32_t address, const Signal &sig, const std::vector<uint8_t> &d);
+unsigned int honda_checksum(uint32_t address, const Signal &sig, DataView d);
+unsigned int toyota_checksum(uint32_t address, const Signal &sig, DataView d);
+unsigned int subaru_checksum(uint32_t address, const Signal &sig, DataView d);
+unsigned int chrysler_checksum(uint32_t address, const Signal &sig, DataView d);
+unsigned int volkswagen_mqb_checksum(uint32_t address, const Signal &sig, DataView d);
+unsigned int xor_checksum(uint32_t address, const Signal &sig, DataView d);
+unsigned int hkg_can_fd_checksum(uint32_t address, const Signal &sig, DataView d);
+unsigned int pedal_checksum(uint32_t address, const Signal &sig, DataView d);
+
+// A signal compiled for extraction: a little endian 8 byte load at byte
+// (byte swapped for big endian signals), then shift, mask and sign extension
+struct SignalExtract {
+  uint16_t byte;
+  uint8_t shift;
+  uint8_t min_size;  // the signal reads as 0 from messages shorter than this
+  bool little_endian;
+  bool generic;  // spans more than 8 bytes, extracted with get_raw_value instead
+  uint64_t mask;
+  uint64_t sign_bit;  // 0 for unsigned signals
+};
+
+int64_t get_raw_value(DataView msg, const Signal &sig);
+SignalExtract compile_signal(const Signal &sig);
 
 class MessageState {
 public:
@@ -42,8 +61,16 @@ public:
   unsigned int size;
 
   std::vector<Signal> parse_sigs;
+  std::vector<SignalExtract> extracts;
+  // from dbc_codegen, replaces the extraction loop when set
+  void (*generated_decode)(const uint8_t *buf, size_t size, int64_t *raw) = nullptr;
+  std::vector<int64_t> raw_vals;
   std::vector<double> vals;
-  std::vector<std::vector<double>> all_vals;
+
+  // ring of MAX_SIGNAL_HISTORY rows of vals, the oldest are dropped if nobody queries
+  std::vector<double> history;
+  uint32_t history_head = 0;  // row written by the next parse
+  uint32_t history_count = 0;  // rows since the last query
 
   uint64_t last_seen_nanos;
   uint64_t check_threshold;
@@ -51,11 +78,15 @@ public:
   uint8_t counter;
   uint8_t counter_fail;
 
+  bool expired = false;  // not seen within check_threshold, maintained by CANParser
+
   bool ignore_checksum = false;
   bool ignore_counter = false;
 
-  bool parse(uint64_t sec, const std::vector<uint8_t> &dat);
+  void compile(const GeneratedMsg *generated = nullptr);
+  bool parse(uint64_t sec, DataView dat);
   bool update_counter_generic(int64_t v, int cnt_size);
+  void drain_history(int sig_index, std::vector<double> &out) const;
 };
 
 class CANParser {
@@ -64,7 +95,21 @@ private:
   kj::Array<capnp::word> aligned_buf;
 
   const DBC *dbc = NULL;
-  std::unordered_map<uint32_t, MessageState> message_states;
+  // sorted by address, stored contiguously
+  std::vector<MessageState> message_states;
+  // index + 1 into message_states of each tracked 11 bit address, 0 if untracked
+  std::array<uint16_t, 0x800> standard_index = {};
+
+  // (deadline, index into message_states) of every checked message that hasn't expired.
+  // Deadlines only move forward, so stale entries are rescheduled when they surface.
+  std::priority_queue<std::pair<uint64_t, uint32_t>, std::vector<std::pair<uint64_t, uint32_t>>,
+                      std::greater<std::pair<uint64_t, uint32_t>>> deadlines;
+  size_t expired_cnt = 0;
+  size_t counter_failed_cnt = 0;
+
+  void init_message_states(std::map<uint32_t, MessageState> &states);
+  MessageState *find_message_state(uint32_t address);
+  void parse_message(MessageState &state, uint64_t sec, DataView dat);
 
 public:
   bool can_valid = false;
@@ -81,22 +126,32 @@ public:
   #ifndef DYNAMIC_CAPNP
   void update_string(const std::string &data, bool sendcan);
   void update_strings(const std::vector<std::string> &data, std::vector<SignalValue> &vals, bool sendcan);
+  void update_strings(const std::vector<std::string> &data, std::vector<MessageValues> &vals, bool sendcan);
   void UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans);
   #endif
   void UpdateCans(uint64_t sec, const capnp::DynamicStruct::Reader& cans);
   void UpdateValid(uint64_t sec);
   void query_latest(std::vector<SignalValue> &vals, uint64_t last_ts = 0);
+  void query_latest(std::vector<MessageValues> &vals, uint64_t last_ts = 0);
 };
 
 class CANPacker {
 private:
   const DBC *dbc = NULL;
-  std::map<std::pair<uint32_t, std::string>, Signal> signal_lookup;
+  struct PackSignal {
+    Signal sig;
+    int index;  // in its message, for the generated encoder
+  };
+  std::map<std::pair<uint32_t, std::string>, PackSignal> signal_lookup;
   std::map<uint32_t, Msg> message_lookup;
+  std::map<uint32_t, const GeneratedMsg *> generated_lookup;
   std::map<uint32_t, uint32_t> counters;
 
 public:
   CANPacker(const std::string& dbc_name);
   std::vector<uint8_t> pack(uint32_t address, const std::vector<SignalPackValue> &values);
   Msg* lookup_message(uint32_t address);
+
+private:
+  void set_signal(std::vector<uint8_t> &msg, const GeneratedMsg *generated, const PackSignal &sig, int64_t ival);
 };
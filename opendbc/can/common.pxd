@@ -8,9 +8,12 @@ from libcpp.string cimport string
 from libcpp.vector cimport vector
 
 
-ctypedef unsigned int (*calc_checksum_type)(uint32_t, const Signal&, const vector[uint8_t] &)
+ctypedef unsigned int (*calc_checksum_type)(uint32_t, const Signal&, DataView)
 
 cdef extern from "common_dbc.h":
+  cdef cppclass DataView:
+    pass
+
   ctypedef enum SignalType:
     DEFAULT,
     COUNTER,
@@ -56,6 +59,13 @@ cdef extern from "common_dbc.h":
     double value
     vector[double] all_values
 
+  cdef struct MessageValues:
+    uint32_t address
+    uint64_t ts_nanos
+    bool updated
+    vector[double] values
+    vector[vector[double]] all_values
+
   cdef struct SignalPackValue:
     string name
     double value
@@ -69,6 +79,8 @@ cdef extern from "common.h":
     bool bus_timeout
     CANParser(int, string, vector[pair[uint32_t, int]])
     void update_strings(vector[string]&, vector[SignalValue]&, bool) except +
+    void update_strings(vector[string]&, vector[MessageValues]&, bool) except +
+    void query_latest(vector[MessageValues]&, uint64_t)
 
   cdef cppclass CANPacker:
    CANPacker(string)
@@ -7,6 +7,30 @@
 
 #define ARRAYSIZE(x) (sizeof(x)/sizeof(x[0]))
 
+// Non-owning view of a CAN payload, so frames can be parsed straight from the capnp blob
+struct DataView {
+  const uint8_t *ptr = nullptr;
+  size_t len = 0;
+
+  DataView() = default;
+  DataView(const uint8_t *ptr, size_t len) : ptr(ptr), len(len) {}
+  DataView(const std::vector<uint8_t> &v) : ptr(v.data()), len(v.size()) {}
+
+  size_t size() const { return len; }
+  const uint8_t *data() const { return ptr; }
+  const uint8_t &operator[](size_t i) const { return ptr[i]; }
+};
+
+// Latest values of one tracked message, refreshed in place by CANParser::query_latest.
+// Signals are in DBC order, so (message index, signal index) identifies a signal.
+struct MessageValues {
+  uint32_t address;
+  uint64_t ts_nanos;
+  bool updated;  // received since the last query
+  std::vector<double> values;  // latest value
+  std::vector<std::vector<double>> all_values;  // all values from this cycle
+};
+
 struct SignalPackValue {
   std::string name;
   double value;
@@ -40,7 +64,7 @@ struct Signal {
   double factor, offset;
   bool is_little_endian;
   SignalType type;
-  unsigned int (*calc_checksum)(uint32_t address, const Signal &sig, const std::vector<uint8_t> &d);
+  unsigned int (*calc_checksum)(uint32_t address, const Signal &sig, DataView d);
 };
 
 struct Msg {
@@ -70,7 +94,7 @@ typedef struct ChecksumState {
   int counter_start_bit;
   bool little_endian;
   SignalType checksum_type;
-  unsigned int (*calc_checksum)(uint32_t address, const Signal &sig, const std::vector<uint8_t> &d);
+  unsigned int (*calc_checksum)(uint32_t address, const Signal &sig, DataView d);
 } ChecksumState;
 
 DBC* dbc_parse(const std::string& dbc_path);
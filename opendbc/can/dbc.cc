@@ -2,9 +2,9 @@
 #include <filesystem>
 #include <fstream>
 #include <map>
-#include <regex>
 #include <set>
 #include <sstream>
+#include <string_view>
 #include <vector>
 #include <mutex>
 #include <iterator>
@@ -14,11 +14,144 @@
 #include "opendbc/can/common.h"
 #include "opendbc/can/common_dbc.h"
 
-std::regex bo_regexp(R"(^BO_ (\w+) (\w+) *: (\w+) (\w+))");
-std::regex sg_regexp(R"(^SG_ (\w+) : (\d+)\|(\d+)@(\d+)([\+|\-]) \(([0-9.+\-eE]+),([0-9.+\-eE]+)\) \[([0-9.+\-eE]+)\|([0-9.+\-eE]+)\] \"(.*)\" (.*))");
-std::regex sgm_regexp(R"(^SG_ (\w+) (\w+) *: (\d+)\|(\d+)@(\d+)([\+|\-]) \(([0-9.+\-eE]+),([0-9.+\-eE]+)\) \[([0-9.+\-eE]+)\|([0-9.+\-eE]+)\] \"(.*)\" (.*))");
-std::regex val_regexp(R"(VAL_ (\w+) (\w+) (\s*[-+]?[0-9]+\s+\".+?\"[^;]*))");
-std::regex val_split_regexp{R"([\"]+)"};  // split on "
+// Single pass cursor over one DBC line. Each method consumes its token and
+// returns true on a match, or leaves the position untouched and returns false.
+// Character classes follow the ECMAScript regexes this replaced.
+class DBCLine {
+public:
+  DBCLine(std::string_view line, size_t pos = 0) : line(line), pos(pos) {}
+
+  bool literal(std::string_view lit) {
+    if (line.compare(pos, lit.size(), lit) != 0) return false;
+    pos += lit.size();
+    return true;
+  }
+  bool word(std::string_view &out) { return span(out, is_word); }  // \w+
+  bool digits(std::string_view &out) { return span(out, is_digit); }  // \d+
+  bool number(std::string_view &out) { return span(out, is_number); }  // [0-9.+\-eE]+
+  bool one_of(const char *chars, char &out) {
+    if (pos >= line.size() || line[pos] == '\0' || strchr(chars, line[pos]) == nullptr) return false;
+    out = line[pos++];
+    return true;
+  }
+  void skip(bool (*cls)(char)) {
+    while (pos < line.size() && cls(line[pos])) pos++;
+  }
+  bool done() const { return pos == line.size(); }
+
+  // "(.*)" (.*) : a quoted string up to the last quote that is followed by a space
+  bool quoted_unit(std::string_view &out) {
+    if (pos >= line.size() || line[pos] != '"') return false;
+    std::string_view head = line.substr(0, std::min(line.find_first_of("\r\n", pos), line.size()));
+    size_t close = head.rfind("\" ");
+    if (close == std::string_view::npos || close <= pos) return false;
+    out = line.substr(pos + 1, close - pos - 1);
+    pos = close + 2;
+    return true;
+  }
+
+  // \s*[-+]?[0-9]+\s+\".+?\"[^;]* : value descriptions up to the first ';' after the first one
+  bool value_descriptions(std::string_view &out) {
+    size_t start = pos, p = pos;
+    while (p < line.size() && is_space(line[p])) p++;
+    if (p < line.size() && (line[p] == '-' || line[p] == '+')) p++;
+    size_t digits_start = p;
+    while (p < line.size() && is_digit(line[p])) p++;
+    if (p == digits_start) return false;
+    size_t spaces_start = p;
+    while (p < line.size() && is_space(line[p])) p++;
+    if (p == spaces_start || p >= line.size() || line[p] != '"') return false;
+    // lazy .+? : at least one character that isn't a line terminator, up to the next quote
+    p++;
+    if (p >= line.size() || is_terminator(line[p])) return false;
+    p++;
+    while (p < line.size() && line[p] != '"') {
+      if (is_terminator(line[p])) return false;
+      p++;
+    }
+    if (p >= line.size()) return false;
+    p = std::min(line.find(';', p + 1), line.size());
+    out = line.substr(start, p - start);
+    pos = p;
+    return true;
+  }
+
+  static bool is_word(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || is_digit(c) || c == '_'; }
+  static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+  static bool is_number(char c) { return is_digit(c) || c == '.' || c == '+' || c == '-' || c == 'e' || c == 'E'; }
+  static bool is_space(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+  static bool is_blank(char c) { return c == ' '; }
+  static bool is_terminator(char c) { return c == '\n' || c == '\r'; }
+
+private:
+  bool span(std::string_view &out, bool (*cls)(char)) {
+    size_t start = pos;
+    skip(cls);
+    if (pos == start) return false;
+    out = line.substr(start, pos - start);
+    return true;
+  }
+
+  std::string_view line;
+  size_t pos;
+};
+
+struct SGFields {
+  std::string_view name, start_bit, size, endianness, min, max, factor, offset, unit;
+  char sign;
+};
+
+// SG_ name [multiplexer] *: start|size@endianness± (factor,offset) [min|max] "unit" receivers
+bool parse_sg(std::string_view line, SGFields &f) {
+  DBCLine l(line);
+  std::string_view mux;
+  if (!l.literal("SG_ ") || !l.word(f.name) || !l.literal(" ")) return false;
+  if (!l.literal(": ")) {
+    if (!l.word(mux)) return false;
+    l.skip(DBCLine::is_blank);
+    if (!l.literal(": ")) return false;
+  }
+  return l.digits(f.start_bit) && l.literal("|") && l.digits(f.size) && l.literal("@") && l.digits(f.endianness) &&
+         l.one_of("+|-", f.sign) && l.literal(" (") && l.number(f.factor) && l.literal(",") && l.number(f.offset) &&
+         l.literal(") [") && l.number(f.min) && l.literal("|") && l.number(f.max) && l.literal("] ") && l.quoted_unit(f.unit);
+}
+
+// BO_ address name *: size transmitter, nothing after
+bool parse_bo(std::string_view line, std::string_view &address, std::string_view &name, std::string_view &size) {
+  DBCLine l(line);
+  std::string_view transmitter;
+  if (!l.literal("BO_ ") || !l.word(address) || !l.literal(" ") || !l.word(name)) return false;
+  l.skip(DBCLine::is_blank);
+  return l.literal(": ") && l.word(size) && l.literal(" ") && l.word(transmitter) && l.done();
+}
+
+// VAL_ address signal value "description" ... ; matched wherever VAL_ appears in the line
+bool parse_val(std::string_view line, std::string_view &address, std::string_view &name, std::string_view &defvals) {
+  for (size_t p = line.find("VAL_ "); p != std::string_view::npos; p = line.find("VAL_ ", p + 1)) {
+    DBCLine l(line, p);
+    if (l.literal("VAL_ ") && l.word(address) && l.literal(" ") && l.word(name) && l.literal(" ") && l.value_descriptions(defvals)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Split on runs of quotes, keeping the leading empty piece like std::sregex_token_iterator
+std::vector<std::string> split_quotes(std::string_view s) {
+  std::vector<std::string> words;
+  size_t p = 0;
+  while (p < s.size()) {
+    size_t q = s.find('"', p);
+    if (q == std::string_view::npos) {
+      words.emplace_back(s.substr(p));
+      break;
+    }
+    words.emplace_back(s.substr(p, q - p));
+    p = s.find_first_not_of('"', q);
+    if (p == std::string_view::npos) break;
+  }
+  return words;
+}
 
 #define DBC_ASSERT(condition, message)                             \
   do {                                                             \
@@ -119,20 +252,19 @@ DBC* dbc_parse_from_stream(const std::string &dbc_name, std::istream &stream, Ch
 
   std::string line;
   int line_num = 0;
-  std::smatch match;
-  // TODO: see if we can speed up the regex statements in this loop, SG_ is specifically the slowest
   while (std::getline(stream, line)) {
     line = trim(line);
     line_num += 1;
     if (startswith(line, "BO_ ")) {
       // new group
-      bool ret = std::regex_match(line, match, bo_regexp);
+      std::string_view msg_address, msg_name, msg_size;
+      bool ret = parse_bo(line, msg_address, msg_name, msg_size);
       DBC_ASSERT(ret, "bad BO: " << line);
 
       Msg& msg = dbc->msgs.emplace_back();
-      address = msg.address = std::stoul(match[1].str());  // could be hex
-      msg.name = match[2].str();
-      msg.size = std::stoul(match[3].str());
+      address = msg.address = std::stoul(std::string(msg_address));  // could be hex
+      msg.name = msg_name;
+      msg.size = std::stoul(std::string(msg_size));
 
       // check for duplicates
       DBC_ASSERT(address_set.find(address) == address_set.end(), "Duplicate message address: " << address << " (" << msg.name << ")");
@@ -144,20 +276,18 @@ DBC* dbc_parse_from_stream(const std::string &dbc_name, std::istream &stream, Ch
       }
     } else if (startswith(line, "SG_ ")) {
       // new signal
-      int offset = 0;
-      if (!std::regex_search(line, match, sg_regexp)) {
-        bool ret = std::regex_search(line, match, sgm_regexp);
-        DBC_ASSERT(ret, "bad SG: " << line);
-        offset = 1;
-      }
+      SGFields f;
+      bool ret = parse_sg(line, f);
+      DBC_ASSERT(ret, "bad SG: " << line);
+
       Signal& sig = signals[address].emplace_back();
-      sig.name = match[1].str();
-      sig.start_bit = std::stoi(match[offset + 2].str());
-      sig.size = std::stoi(match[offset + 3].str());
-      sig.is_little_endian = std::stoi(match[offset + 4].str()) == 1;
-      sig.is_signed = match[offset + 5].str() == "-";
-      sig.factor = std::stod(match[offset + 6].str());
-      sig.offset = std::stod(match[offset + 7].str());
+      sig.name = f.name;
+      sig.start_bit = std::stoi(std::string(f.start_bit));
+      sig.size = std::stoi(std::string(f.size));
+      sig.is_little_endian = std::stoi(std::string(f.endianness)) == 1;
+      sig.is_signed = f.sign == '-';
+      sig.factor = std::stod(std::string(f.factor));
+      sig.offset = std::stod(std::string(f.offset));
       set_signal_type(sig, checksum, dbc_name, line_num);
       if (sig.is_little_endian) {
         sig.lsb = sig.start_bit;
@@ -174,17 +304,16 @@ DBC* dbc_parse_from_stream(const std::string &dbc_name, std::istream &stream, Ch
       signal_name_sets[address].insert(sig.name);
     } else if (startswith(line, "VAL_ ")) {
       // new signal value/definition
-      bool ret = std::regex_search(line, match, val_regexp);
+      std::string_view val_address, val_name, defvals;
+      bool ret = parse_val(line, val_address, val_name, defvals);
       DBC_ASSERT(ret, "bad VAL: " << line);
 
       auto& val = dbc->vals.emplace_back();
-      val.address = std::stoul(match[1].str());  // could be hex
-      val.name = match[2].str();
+      val.address = std::stoul(std::string(val_address));  // could be hex
+      val.name = val_name;
 
-      auto defvals = match[3].str();
-      std::sregex_token_iterator it{defvals.begin(), defvals.end(), val_split_regexp, -1};
       // convert strings to UPPER_CASE_WITH_UNDERSCORES
-      std::vector<std::string> words{it, {}};
+      std::vector<std::string> words = split_quotes(defvals);
       for (auto& w : words) {
         w = trim(w);
         std::transform(w.begin(), w.end(), w.begin(), ::toupper);
@@ -227,20 +356,26 @@ const std::string get_dbc_root_path() {
 }
 
 const DBC* dbc_lookup(const std::string& dbc_name) {
+  struct CachedDBC {
+    std::once_flag parsed;
+    DBC *dbc = nullptr;
+  };
   static std::mutex lock;
-  static std::map<std::string, DBC*> dbcs;
+  static std::map<std::string, CachedDBC> dbcs;
 
   std::string dbc_file_path = dbc_name;
   if (!std::filesystem::exists(dbc_file_path)) {
     dbc_file_path = get_dbc_root_path() + "/" + dbc_name + ".dbc";
   }
 
-  std::unique_lock lk(lock);
-  auto it = dbcs.find(dbc_name);
-  if (it == dbcs.end()) {
-    it = dbcs.insert(it, {dbc_name, dbc_parse(dbc_file_path)});
+  // the global lock only covers the map, so different DBCs are parsed in parallel
+  CachedDBC *cached;
+  {
+    std::unique_lock lk(lock);
+    cached = &dbcs[dbc_name];
   }
-  return it->second;
+  std::call_once(cached->parsed, [&] { cached->dbc = dbc_parse(dbc_file_path); });
+  return cached->dbc;
 }
 
 std::vector<std::string> get_dbc_names() {
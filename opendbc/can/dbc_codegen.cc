@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "opendbc/can/common.h"
+
+// Writes a header with a constexpr message table and a decode and encode
+// function specialized for every message of the given DBCs (all by default).
+// Offsets, masks and sign bits come from compile_signal, so the generated
+// decoders match MessageState's extraction bit for bit.
+//
+// usage: dbc_codegen <output header> [dbc name ...]
+
+static std::string identifier(const std::string &name) {
+  std::string ret = "dbc_";
+  for (char c : name) {
+    ret += isalnum((unsigned char)c) ? c : '_';
+  }
+  return ret;
+}
+
+static std::string hex(uint64_t v) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "0x%llxULL", (unsigned long long)v);
+  return buf;
+}
+
+static void write_decode(FILE *f, const Msg &msg) {
+  fprintf(f, "inline void decode_%X(const uint8_t *buf, size_t size, int64_t *raw) {\n", msg.address);
+  for (int i = 0; i < msg.sigs.size(); i++) {
+    const Signal &sig = msg.sigs[i];
+    SignalExtract e = compile_signal(sig);
+    if (e.generic) {
+      fprintf(f, "  // %s spans more than 8 bytes, MessageState reads it with get_raw_value\n", sig.name.c_str());
+      continue;
+    }
+
+    std::string v = std::string(e.little_endian ? "dbc_load_le" : "dbc_load_be") + "(buf + " + std::to_string(e.byte) + ")";
+    if (e.shift > 0) v = "(" + v + " >> " + std::to_string(e.shift) + ")";
+    if (e.mask != ~0ULL) v = "(" + v + " & " + hex(e.mask) + ")";
+    if (e.sign_bit != 0) v = "((" + v + " ^ " + hex(e.sign_bit) + ") - " + hex(e.sign_bit) + ")";
+    v = "(int64_t)" + v;
+    if (e.min_size > 0) v = "size < " + std::to_string(e.min_size) + " ? 0 : " + v;
+    fprintf(f, "  raw[%d] = %s;  // %s\n", i, v.c_str(), sig.name.c_str());
+  }
+  fprintf(f, "}\n\n");
+}
+
+// Unrolls set_value from packer.cc: the same bytes, masks and bounds checks
+static void write_encode(FILE *f, const Msg &msg) {
+  fprintf(f, "inline void encode_%X(uint8_t *dat, size_t size, int sig_index, int64_t ival) {\n", msg.address);
+  fprintf(f, "  uint64_t v = ival;\n");
+  fprintf(f, "  switch (sig_index) {\n");
+  for (int s = 0; s < msg.sigs.size(); s++) {
+    const Signal &sig = msg.sigs[s];
+    fprintf(f, "    case %d:  // %s\n", s, sig.name.c_str());
+    if (sig.size < 64) {
+      fprintf(f, "      v &= %s;\n", hex((1ULL << sig.size) - 1).c_str());
+    }
+
+    int i = sig.lsb / 8;
+    int bits = sig.size;
+    int consumed = 0;
+    int max_byte = i;
+    while (i >= 0 && i < 64 && bits > 0) {
+      int shift = (int)(sig.lsb / 8) == i ? sig.lsb % 8 : 0;
+      int size = std::min(bits, 8 - shift);
+      uint64_t piece_mask = (1ULL << size) - 1;
+      unsigned keep = ~(piece_mask << shift) & 0xFF;
+
+      // set_value stops at the first byte past the end, big endian signals go down from the lsb byte
+      max_byte = std::max(max_byte, i);
+      fprintf(f, "      if (size > %d) dat[%d] = (dat[%d] & 0x%02X) | (((v >> %d) & 0x%llX) << %d);\n",
+              max_byte, i, i, keep, consumed, (unsigned long long)piece_mask, shift);
+
+      bits -= size;
+      consumed += size;
+      i = sig.is_little_endian ? i+1 : i-1;
+    }
+    fprintf(f, "      break;\n");
+  }
+  fprintf(f, "  }\n");
+  fprintf(f, "}\n\n");
+}
+
+static void write_dbc(FILE *f, const DBC *dbc) {
+  std::vector<const Msg *> msgs;
+  for (const auto &msg : dbc->msgs) msgs.push_back(&msg);
+  std::sort(msgs.begin(), msgs.end(), [](const Msg *a, const Msg *b) { return a->address < b->address; });
+
+  fprintf(f, "namespace %s {\n\n", identifier(dbc->name).c_str());
+  for (const Msg *msg : msgs) {
+    fprintf(f, "// %s\n", msg->name.c_str());
+    if (!msg->sigs.empty()) {
+      fprintf(f, "constexpr GeneratedSignal sigs_%X[] = {\n", msg->address);
+      for (const auto &sig : msg->sigs) {
+        fprintf(f, "  {\"%s\", %d, %d, %d, %s, %s, %.17g, %.17g, (SignalType)%d},\n", sig.name.c_str(), sig.lsb, sig.msb,
+                sig.size, sig.is_signed ? "true" : "false", sig.is_little_endian ? "true" : "false", sig.factor, sig.offset, sig.type);
+      }
+      fprintf(f, "};\n\n");
+    }
+    write_decode(f, *msg);
+    write_encode(f, *msg);
+  }
+
+  fprintf(f, "constexpr GeneratedMsg msgs[] = {\n");
+  for (const Msg *msg : msgs) {
+    char sigs[32] = "nullptr";
+    if (!msg->sigs.empty()) snprintf(sigs, sizeof(sigs), "sigs_%X", msg->address);
+    fprintf(f, "  {0x%X, \"%s\", %u, %s, %zu, decode_%X, encode_%X},\n", msg->address, msg->name.c_str(), msg->size,
+            sigs, msg->sigs.size(), msg->address, msg->address);
+  }
+  fprintf(f, "};\n\n");
+  fprintf(f, "}  // namespace %s\n\n", identifier(dbc->name).c_str());
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <output header> [dbc name ...]\n", argv[0]);
+    return 1;
+  }
+  std::vector<std::string> dbc_names(argv + 2, argv + argc);
+  if (dbc_names.empty()) dbc_names = get_dbc_names();
+  std::sort(dbc_names.begin(), dbc_names.end());
+
+  FILE *f = fopen(argv[1], "w");
+  if (f == nullptr) {
+    perror(argv[1]);
+    return 1;
+  }
+  fprintf(f, "// Generated by dbc_codegen, do not edit\n\n");
+  fprintf(f, "#pragma once\n\n");
+  fprintf(f, "#include \"opendbc/can/generated_dbc.h\"\n\n");
+
+  std::vector<const DBC *> dbcs;
+  for (const auto &name : dbc_names) {
+    const DBC *dbc = dbc_lookup(name);
+    if (dbc == nullptr) {
+      fprintf(stderr, "can't find DBC %s\n", name.c_str());
+      return 1;
+    }
+    write_dbc(f, dbc);
+    dbcs.push_back(dbc);
+  }
+
+  fprintf(f, "constexpr GeneratedDBC generated_dbc_table[] = {\n");
+  for (const DBC *dbc : dbcs) {
+    fprintf(f, "  {\"%s\", %s::msgs, %zu},\n", dbc->name.c_str(), identifier(dbc->name).c_str(), dbc->msgs.size());
+  }
+  fprintf(f, "};\n\n");
+  fprintf(f, "static const GeneratedDBC *generated_dbcs = generated_dbc_table;\n");
+  fprintf(f, "static const size_t num_generated_dbcs = %zu;\n", dbcs.size());
+  return fclose(f) == 0 ? 0 : 1;
+}
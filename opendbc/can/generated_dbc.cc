@@ -0,0 +1,36 @@
+#include "opendbc/can/generated_dbc.h"
+
+#include <algorithm>
+
+#ifdef DBC_CODEGEN
+#include "opendbc/can/generated_dbcs.h"
+#else
+static const GeneratedDBC *generated_dbcs = nullptr;
+static const size_t num_generated_dbcs = 0;
+#endif
+
+static bool generated_matches(const GeneratedMsg &gen, const Msg &msg) {
+  if (gen.size != msg.size || gen.num_sigs != msg.sigs.size()) return false;
+  for (size_t i = 0; i < gen.num_sigs; i++) {
+    const GeneratedSignal &g = gen.sigs[i];
+    const Signal &s = msg.sigs[i];
+    if (g.name != s.name || g.lsb != s.lsb || g.msb != s.msb || g.size != s.size || g.is_signed != s.is_signed ||
+        g.is_little_endian != s.is_little_endian || g.factor != s.factor || g.offset != s.offset || g.type != s.type) {
+      return false;
+    }
+  }
+  return true;
+}
+
+const GeneratedMsg *generated_msg_lookup(const std::string &dbc_name, const Msg &msg) {
+  for (size_t i = 0; i < num_generated_dbcs; i++) {
+    const GeneratedDBC &dbc = generated_dbcs[i];
+    if (dbc_name != dbc.name) continue;
+
+    const GeneratedMsg *end = dbc.msgs + dbc.num_msgs;
+    const GeneratedMsg *it = std::lower_bound(dbc.msgs, end, msg.address,
+                                              [](const GeneratedMsg &m, uint32_t address) { return m.address < address; });
+    return (it != end && it->address == msg.address && generated_matches(*it, msg)) ? it : nullptr;
+  }
+  return nullptr;
+}
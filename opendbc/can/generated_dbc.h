@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "opendbc/can/common_dbc.h"
+
+// Decoders and encoders specialized per message by dbc_codegen. They are only
+// built with scons --dbc-codegen; without them CANParser and CANPacker use the
+// runtime DBC.
+
+struct GeneratedSignal {
+  const char *name;
+  int lsb, msb, size;
+  bool is_signed;
+  bool is_little_endian;
+  double factor, offset;
+  SignalType type;
+};
+
+struct GeneratedMsg {
+  uint32_t address;
+  const char *name;
+  unsigned int size;
+  const GeneratedSignal *sigs;
+  size_t num_sigs;
+
+  // Raw values of every signal that fits an 8 byte load, read from a zero padded
+  // copy of a frame of the given size. Same results as MessageState's compiled
+  // extraction; signals spanning more than 8 bytes are left untouched.
+  void (*decode)(const uint8_t *buf, size_t size, int64_t *raw);
+  // Sets signal sig_index of dat like set_value in packer.cc
+  void (*encode)(uint8_t *dat, size_t size, int sig_index, int64_t ival);
+};
+
+struct GeneratedDBC {
+  const char *name;
+  const GeneratedMsg *msgs;  // sorted by address
+  size_t num_msgs;
+};
+
+// The generated message for msg, or nullptr if there is none or it no longer
+// matches the DBC's signal layout
+const GeneratedMsg *generated_msg_lookup(const std::string &dbc_name, const Msg &msg);
+
+inline uint64_t dbc_load_le(const uint8_t *p) {
+  uint64_t w;
+  memcpy(&w, p, sizeof(w));
+  return w;
+}
+
+inline uint64_t dbc_load_be(const uint8_t *p) {
+  return __builtin_bswap64(dbc_load_le(p));
+}
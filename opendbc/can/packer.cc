@@ -34,15 +34,25 @@ CANPacker::CANPacker(const std::string& dbc_name) {
 
   for (const auto& msg : dbc->msgs) {
     message_lookup[msg.address] = msg;
-    for (const auto& sig : msg.sigs) {
-      signal_lookup[std::make_pair(msg.address, std::string(sig.name))] = sig;
+    for (int i = 0; i < msg.sigs.size(); i++) {
+      signal_lookup[std::make_pair(msg.address, std::string(msg.sigs[i].name))] = {msg.sigs[i], i};
     }
+    generated_lookup[msg.address] = generated_msg_lookup(dbc->name, msg);
   }
   init_crc_lookup_tables();
 }
 
+void CANPacker::set_signal(std::vector<uint8_t> &msg, const GeneratedMsg *generated, const PackSignal &sig, int64_t ival) {
+  if (generated != nullptr) {
+    generated->encode(msg.data(), msg.size(), sig.index, ival);
+  } else {
+    set_value(msg, sig.sig, ival);
+  }
+}
+
 std::vector<uint8_t> CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &signals) {
   std::vector<uint8_t> ret(message_lookup[address].size, 0);
+  const GeneratedMsg *generated = generated_lookup[address];
 
   // set all values for all given signal/value pairs
   bool counter_set = false;
@@ -53,13 +63,13 @@ std::vector<uint8_t> CANPacker::pack(uint32_t address, const std::vector<SignalP
       WARN("undefined signal %s - %d\n", sigval.name.c_str(), address);
       continue;
     }
-    const auto &sig = sig_it->second;
+    const auto &sig = sig_it->second.sig;
 
     int64_t ival = (int64_t)(round((sigval.value - sig.offset) / sig.factor));
     if (ival < 0) {
       ival = (1ULL << sig.size) + ival;
     }
-    set_value(ret, sig, ival);
+    set_signal(ret, generated, sig_it->second, ival);
 
     counter_set = counter_set || (sigval.name == "COUNTER");
     if (counter_set) {
@@ -70,22 +80,22 @@ std::vector<uint8_t> CANPacker::pack(uint32_t address, const std::vector<SignalP
   // set message counter
   auto sig_it_counter = signal_lookup.find(std::make_pair(address, "COUNTER"));
   if (!counter_set && sig_it_counter != signal_lookup.end()) {
-    const auto& sig = sig_it_counter->second;
+    const auto& sig = sig_it_counter->second.sig;
 
     if (counters.find(address) == counters.end()) {
       counters[address] = 0;
     }
-    set_value(ret, sig, counters[address]);
+    set_signal(ret, generated, sig_it_counter->second, counters[address]);
     counters[address] = (counters[address] + 1) % (1 << sig.size);
   }
 
   // set message checksum
   auto sig_it_checksum = signal_lookup.find(std::make_pair(address, "CHECKSUM"));
   if (sig_it_checksum != signal_lookup.end()) {
-    const auto &sig = sig_it_checksum->second;
+    const auto &sig = sig_it_checksum->second.sig;
     if (sig.calc_checksum != nullptr) {
       unsigned int checksum = sig.calc_checksum(address, sig, ret);
-      set_value(ret, sig, checksum);
+      set_signal(ret, generated, sig_it_checksum->second, checksum);
     }
   }
 
@@ -11,33 +11,46 @@
 #include "cereal/logger/logger.h"
 #include "opendbc/can/common.h"
 
-int64_t get_raw_value(const std::vector<uint8_t> &msg, const Signal &sig) {
-  int64_t ret = 0;
-
-  int i = sig.msb / 8;
-  int bits = sig.size;
-  while (i >= 0 && i < msg.size() && bits > 0) {
-    int lsb = (int)(sig.lsb / 8) == i ? sig.lsb : i*8;
-    int msb = (int)(sig.msb / 8) == i ? sig.msb : (i+1)*8 - 1;
-    int size = msb - lsb + 1;
-
-    uint64_t d = (msg[i] >> (lsb - (i*8))) & ((1ULL << size) - 1);
-    ret |= d << (bits - size);
-
-    bits -= size;
-    i = sig.is_little_endian ? i-1 : i+1;
+void MessageState::compile(const GeneratedMsg *generated) {
+  extracts.clear();
+  for (const auto &sig : parse_sigs) {
+    extracts.push_back(compile_signal(sig));
   }
-  return ret;
+  raw_vals.resize(parse_sigs.size());
+  history.assign(MAX_SIGNAL_HISTORY * parse_sigs.size(), 0);
+  history_head = history_count = 0;
+  generated_decode = generated != nullptr ? generated->decode : nullptr;
 }
 
+bool MessageState::parse(uint64_t sec, DataView dat) {
+  // Zero padded so every 8 byte load stays in bounds
+  uint8_t buf[64 + 8] = {0};
+  memcpy(buf, dat.data(), std::min(dat.size(), (size_t)64));
+
+  // Extract everything first, this loop has no data dependent branches
+  if (generated_decode != nullptr) {
+    generated_decode(buf, dat.size(), raw_vals.data());
+  } else {
+    for (int i = 0; i < extracts.size(); i++) {
+      const auto &e = extracts[i];
+      uint64_t w;
+      memcpy(&w, buf + e.byte, sizeof(w));
+      w = e.little_endian ? w : __builtin_bswap64(w);
+      uint64_t v = (w >> e.shift) & e.mask;
+      v = (v ^ e.sign_bit) - e.sign_bit;
+      raw_vals[i] = dat.size() < e.min_size ? 0 : v;
+    }
+  }
 
-bool MessageState::parse(uint64_t sec, const std::vector<uint8_t> &dat) {
   for (int i = 0; i < parse_sigs.size(); i++) {
     const auto &sig = parse_sigs[i];
 
-    int64_t tmp = get_raw_value(dat, sig);
-    if (sig.is_signed) {
-      tmp -= ((tmp >> (sig.size-1)) & 0x1) ? (1ULL << sig.size) : 0;
+    int64_t tmp = raw_vals[i];
+    if (extracts[i].generic) {
+      tmp = get_raw_value(dat, sig);
+      if (sig.is_signed) {
+        tmp -= ((tmp >> (sig.size-1)) & 0x1) ? (1ULL << sig.size) : 0;
+      }
     }
 
     //DEBUG("parse 0x%X %s -> %ld\n", address, sig.name, tmp);
@@ -63,10 +76,13 @@ bool MessageState::parse(uint64_t sec, const std::vector<uint8_t> &dat) {
 
     // TODO: these may get updated if the invalid or checksum gets checked later
     vals[i] = tmp * sig.factor + sig.offset;
-    all_vals[i].push_back(vals[i]);
   }
   last_seen_nanos = sec;
 
+  std::copy(vals.begin(), vals.end(), history.begin() + history_head * vals.size());
+  history_head = (history_head + 1) % MAX_SIGNAL_HISTORY;
+  history_count = std::min(history_count + 1, (uint32_t)MAX_SIGNAL_HISTORY);
+
   return true;
 }
 
@@ -88,6 +104,15 @@ bool MessageState::update_counter_generic(int64_t v, int cnt_size) {
   return true;
 }
 
+// Values of one signal since the last query, oldest first
+void MessageState::drain_history(int sig_index, std::vector<double> &out) const {
+  out.clear();
+  for (uint32_t n = history_count; n > 0; n--) {
+    uint32_t row = (history_head + MAX_SIGNAL_HISTORY - n) % MAX_SIGNAL_HISTORY;
+    out.push_back(history[row * vals.size() + sig_index]);
+  }
+}
+
 
 CANParser::CANParser(int abus, const std::string& dbc_name, const std::vector<std::pair<uint32_t, int>> &messages)
   : bus(abus), aligned_buf(kj::heapArray<capnp::word>(1024)) {
@@ -97,8 +122,9 @@ CANParser::CANParser(int abus, const std::string& dbc_name, const std::vector<st
 
   bus_timeout_threshold = std::numeric_limits<uint64_t>::max();
 
+  std::map<uint32_t, MessageState> states;
   for (const auto& [address, frequency] : messages) {
-    MessageState &state = message_states[address];
+    MessageState &state = states[address];
     state.address = address;
     // state.check_frequency = op.check_frequency,
 
@@ -129,8 +155,9 @@ CANParser::CANParser(int abus, const std::string& dbc_name, const std::vector<st
     // track all signals for this message
     state.parse_sigs = msg->sigs;
     state.vals.resize(msg->sigs.size());
-    state.all_vals.resize(msg->sigs.size());
+    state.compile(generated_msg_lookup(dbc->name, *msg));
   }
+  init_message_states(states);
 }
 
 CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum, bool ignore_counter)
@@ -141,6 +168,7 @@ CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum
   assert(dbc);
   init_crc_lookup_tables();
 
+  std::map<uint32_t, MessageState> states;
   for (const auto& msg : dbc->msgs) {
     MessageState state = {
       .name = msg.name,
@@ -153,13 +181,59 @@ CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum
     for (const auto& sig : msg.sigs) {
       state.parse_sigs.push_back(sig);
       state.vals.push_back(0);
-      state.all_vals.push_back({});
     }
+    state.compile(generated_msg_lookup(dbc->name, msg));
+
+    states[state.address] = state;
+  }
+  init_message_states(states);
+}
+
+void CANParser::init_message_states(std::map<uint32_t, MessageState> &states) {
+  message_states.clear();
+  message_states.reserve(states.size());
+  for (auto &[address, state] : states) {
+    message_states.push_back(std::move(state));
+  }
+
+  standard_index.fill(0);
+  for (int i = 0; i < message_states.size(); i++) {
+    if (message_states[i].address < standard_index.size()) {
+      standard_index[message_states[i].address] = i + 1;
+    }
+  }
 
-    message_states[state.address] = state;
+  // checked messages start out missing
+  for (auto &state : message_states) {
+    state.expired = state.check_threshold > 0;
+    expired_cnt += state.expired;
   }
 }
 
+void CANParser::parse_message(MessageState &state, uint64_t sec, DataView dat) {
+  bool counter_failed = state.counter_fail >= MAX_BAD_COUNTER;
+  bool parsed = state.parse(sec, dat);
+  counter_failed_cnt += (state.counter_fail >= MAX_BAD_COUNTER) - counter_failed;
+
+  if (parsed && state.expired) {
+    state.expired = false;
+    expired_cnt--;
+    deadlines.push({state.last_seen_nanos + state.check_threshold, &state - message_states.data()});
+  }
+}
+
+MessageState *CANParser::find_message_state(uint32_t address) {
+  if (address < standard_index.size()) {
+    uint16_t idx = standard_index[address];
+    return idx == 0 ? nullptr : &message_states[idx - 1];
+  }
+
+  // extended addresses sort after every standard one
+  auto it = std::lower_bound(message_states.begin(), message_states.end(), address,
+                             [](const MessageState &state, uint32_t addr) { return state.address < addr; });
+  return (it != message_states.end() && it->address == address) ? &*it : nullptr;
+}
+
 #ifndef DYNAMIC_CAPNP
 void CANParser::update_string(const std::string &data, bool sendcan) {
   // format for board, make copy due to alignment issues.
@@ -195,6 +269,17 @@ void CANParser::update_strings(const std::vector<std::string> &data, std::vector
   query_latest(vals, current_sec);
 }
 
+void CANParser::update_strings(const std::vector<std::string> &data, std::vector<MessageValues> &vals, bool sendcan) {
+  uint64_t current_sec = 0;
+  for (const auto &d : data) {
+    update_string(d, sendcan);
+    if (current_sec == 0) {
+      current_sec = last_sec;
+    }
+  }
+  query_latest(vals, current_sec);
+}
+
 void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans) {
   //DEBUG("got %d messages\n", cans.size());
 
@@ -208,8 +293,8 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Rea
     }
     bus_empty = false;
 
-    auto state_it = message_states.find(cmsg.getAddress());
-    if (state_it == message_states.end()) {
+    MessageState *state = find_message_state(cmsg.getAddress());
+    if (state == nullptr) {
       // DEBUG("skip %d: not specified\n", cmsg.getAddress());
       continue;
     }
@@ -222,14 +307,12 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Rea
     }
 
     // TODO: this actually triggers for some cars. fix and enable this
-    //if (dat.size() != state_it->second.size) {
-    //  DEBUG("got message with unexpected length: expected %d, got %zu for %d", state_it->second.size, dat.size(), cmsg.getAddress());
+    //if (dat.size() != state->size) {
+    //  DEBUG("got message with unexpected length: expected %d, got %zu for %d", state->size, dat.size(), cmsg.getAddress());
     //  continue;
     //}
 
-    std::vector<uint8_t> data(dat.size(), 0);
-    memcpy(data.data(), dat.begin(), dat.size());
-    state_it->second.parse(sec, data);
+    parse_message(*state, sec, {dat.begin(), dat.size()});
   }
 
   // update bus timeout
@@ -249,54 +332,56 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::DynamicStruct::Reader& cms
     return;
   }
 
-  auto state_it = message_states.find(cmsg.get("address").as<uint32_t>());
-  if (state_it == message_states.end()) {
+  MessageState *state = find_message_state(cmsg.get("address").as<uint32_t>());
+  if (state == nullptr) {
     DEBUG("skip %d: not specified\n", cmsg.get("address").as<uint32_t>());
     return;
   }
 
   auto dat = cmsg.get("dat").as<capnp::Data>();
   if (dat.size() > 64) return; // shouldn't ever happen
-  std::vector<uint8_t> data(dat.size(), 0);
-  memcpy(data.data(), dat.begin(), dat.size());
-  state_it->second.parse(sec, data);
+  parse_message(*state, sec, {dat.begin(), dat.size()});
 }
 
 void CANParser::UpdateValid(uint64_t sec) {
   const bool show_missing = (last_sec - first_sec) > 8e9;
 
-  bool _valid = true;
-  bool _counters_valid = true;
-  for (const auto& kv : message_states) {
-    const auto& state = kv.second;
-
-    if (state.counter_fail >= MAX_BAD_COUNTER) {
-      _counters_valid = false;
+  // only messages whose deadline passed are looked at
+  while (!deadlines.empty() && deadlines.top().first < sec) {
+    uint32_t idx = deadlines.top().second;
+    deadlines.pop();
+
+    auto &state = message_states[idx];
+    uint64_t deadline = state.last_seen_nanos + state.check_threshold;
+    if (deadline >= sec) {
+      deadlines.push({deadline, idx});
+    } else {
+      state.expired = true;
+      expired_cnt++;
     }
+  }
+
+  if (expired_cnt > 0 && show_missing && !bus_timeout) {
+    for (const auto& state : message_states) {
+      if (!state.expired) continue;
 
-    const bool missing = state.last_seen_nanos == 0;
-    const bool timed_out = (sec - state.last_seen_nanos) > state.check_threshold;
-    if (state.check_threshold > 0 && (missing || timed_out)) {
-      if (show_missing && !bus_timeout) {
-        if (missing) {
-          LOGE("0x%X '%s' NOT SEEN", state.address, state.name.c_str());
-        } else if (timed_out) {
-          LOGE("0x%X '%s' TIMED OUT", state.address, state.name.c_str());
-        }
+      if (state.last_seen_nanos == 0) {
+        LOGE("0x%X '%s' NOT SEEN", state.address, state.name.c_str());
+      } else {
+        LOGE("0x%X '%s' TIMED OUT", state.address, state.name.c_str());
       }
-      _valid = false;
     }
   }
-  can_invalid_cnt = _valid ? 0 : (can_invalid_cnt + 1);
-  can_valid = (can_invalid_cnt < CAN_INVALID_CNT) && _counters_valid;
+
+  can_invalid_cnt = expired_cnt == 0 ? 0 : (can_invalid_cnt + 1);
+  can_valid = (can_invalid_cnt < CAN_INVALID_CNT) && counter_failed_cnt == 0;
 }
 
 void CANParser::query_latest(std::vector<SignalValue> &vals, uint64_t last_ts) {
   if (last_ts == 0) {
     last_ts = last_sec;
   }
-  for (auto& kv : message_states) {
-    auto& state = kv.second;
+  for (auto& state : message_states) {
     if (last_ts != 0 && state.last_seen_nanos < last_ts) {
       continue;
     }
@@ -308,8 +393,34 @@ void CANParser::query_latest(std::vector<SignalValue> &vals, uint64_t last_ts) {
       v.ts_nanos = state.last_seen_nanos;
       v.name = sig.name;
       v.value = state.vals[i];
-      v.all_values = state.all_vals[i];
-      state.all_vals[i].clear();
+      state.drain_history(i, v.all_values);
+    }
+    state.history_count = 0;
+  }
+}
+
+// Refreshes vals in place, one entry per tracked message in address order. Once
+// sized, this does not allocate unless a signal's history outgrows its buffer.
+void CANParser::query_latest(std::vector<MessageValues> &vals, uint64_t last_ts) {
+  if (last_ts == 0) {
+    last_ts = last_sec;
+  }
+  vals.resize(message_states.size());
+  for (int m = 0; m < message_states.size(); m++) {
+    auto &state = message_states[m];
+    MessageValues &v = vals[m];
+    v.address = state.address;
+    v.updated = !(last_ts != 0 && state.last_seen_nanos < last_ts);
+    if (!v.updated) {
+      continue;
+    }
+
+    v.ts_nanos = state.last_seen_nanos;
+    v.values = state.vals;
+    v.all_values.resize(state.parse_sigs.size());
+    for (int i = 0; i < state.parse_sigs.size(); i++) {
+      state.drain_history(i, v.all_values[i]);
     }
+    state.history_count = 0;
   }
 }
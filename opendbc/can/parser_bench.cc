@@ -0,0 +1,250 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/util.h"
+#include "opendbc/can/common.h"
+
+// Time to extract every signal of a message, per DBC: the byte by byte
+// get_raw_value loop versus MessageState::parse with compiled extraction, and
+// with the dbc_codegen decoders when they were built. Generated decoders are
+// checked against compiled extraction first, a mismatch exits non zero.
+//
+// usage: parser_bench [dbc name] [iterations]
+//
+// With --replay, feeds the can events of an uncompressed rlog through a
+// CANParser twice and reports the time and heap allocations per event of the
+// second pass. Exits non zero if ingestion allocated.
+//
+// usage: parser_bench --replay <rlog> <dbc name> [bus]
+//
+// With --startup, times parsing every DBC file, first one at a time and then
+// through dbc_lookup from one thread per DBC.
+//
+// usage: parser_bench --startup
+
+static std::atomic<uint64_t> allocations{0};
+
+void *operator new(size_t size) {
+  allocations++;
+  void *p = malloc(size);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+static uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct BenchMessage {
+  MessageState state;
+  std::vector<std::vector<uint8_t>> payloads;
+  std::vector<std::vector<double>> all_vals;  // per signal history of the legacy path
+};
+
+// MessageState::parse as it was before compiled extraction, checks are ignored in both
+static double bench_legacy(std::vector<BenchMessage> &msgs, int iterations) {
+  uint64_t start = now_ns();
+  for (int it = 0; it < iterations; it++) {
+    for (auto &m : msgs) {
+      const auto &dat = m.payloads[it % m.payloads.size()];
+      for (int i = 0; i < m.state.parse_sigs.size(); i++) {
+        const Signal &sig = m.state.parse_sigs[i];
+        int64_t tmp = get_raw_value(dat, sig);
+        if (sig.is_signed) {
+          tmp -= ((tmp >> (sig.size-1)) & 0x1) ? (1ULL << sig.size) : 0;
+        }
+        m.state.vals[i] = tmp * sig.factor + sig.offset;
+        m.all_vals[i].push_back(m.state.vals[i]);
+      }
+      m.state.last_seen_nanos = it;
+    }
+    if (it % 100 == 0) {
+      for (auto &m : msgs) {
+        for (auto &v : m.all_vals) v.clear();
+      }
+    }
+  }
+  return (double)(now_ns() - start) / (iterations * msgs.size());
+}
+
+static double bench_compiled(std::vector<BenchMessage> &msgs, int iterations) {
+  uint64_t start = now_ns();
+  for (int it = 0; it < iterations; it++) {
+    for (auto &m : msgs) {
+      m.state.parse(it, m.payloads[it % m.payloads.size()]);
+    }
+    if (it % 100 == 0) {
+      for (auto &m : msgs) {
+        m.state.history_count = 0;
+      }
+    }
+  }
+  return (double)(now_ns() - start) / (iterations * msgs.size());
+}
+
+// Serialized can events from an uncompressed rlog
+static std::vector<std::string> read_can_events(const std::string &path) {
+  std::string raw = util::read_file(path);
+  kj::Array<capnp::word> words = kj::heapArray<capnp::word>(raw.size() / sizeof(capnp::word));
+  memcpy(words.begin(), raw.data(), words.size() * sizeof(capnp::word));
+
+  std::vector<std::string> events;
+  kj::ArrayPtr<const capnp::word> remaining = words;
+  try {
+    while (remaining.size() > 0) {
+      capnp::FlatArrayMessageReader reader(remaining);
+      if (reader.getRoot<cereal::Event>().isCan()) {
+        auto bytes = kj::ArrayPtr<const capnp::word>(remaining.begin(), reader.getEnd()).asBytes();
+        events.emplace_back((const char *)bytes.begin(), bytes.size());
+      }
+      remaining = kj::arrayPtr(reader.getEnd(), remaining.end());
+    }
+  } catch (const kj::Exception &e) {
+    fprintf(stderr, "stopped reading %s at a malformed event: %s\n", path.c_str(), e.getDescription().cStr());
+  }
+  return events;
+}
+
+static int replay(const std::string &path, const std::string &dbc_name, int bus) {
+  std::vector<std::string> events = read_can_events(path);
+  if (events.empty()) {
+    fprintf(stderr, "no can events in %s\n", path.c_str());
+    return 1;
+  }
+
+  CANParser parser(bus, dbc_name, false, false);
+  std::vector<MessageValues> vals;
+  uint64_t pass_ns = 0, pass_allocations = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    pass_ns = pass_allocations = 0;
+    for (const auto &e : events) {
+      uint64_t start_allocations = allocations;
+      uint64_t start = now_ns();
+      parser.update_string(e, false);
+      pass_ns += now_ns() - start;
+      pass_allocations += allocations - start_allocations;
+
+      // outside the measured region, drains the history like a consumer would
+      parser.query_latest(vals);
+    }
+  }
+
+  printf("%s: %zu can events, %.1f ns/event, %.3f allocations/event\n", dbc_name.c_str(), events.size(),
+         (double)pass_ns / events.size(), (double)pass_allocations / events.size());
+  return pass_allocations == 0 ? 0 : 1;
+}
+
+static int startup() {
+  std::vector<std::string> dbc_names = get_dbc_names();
+  std::sort(dbc_names.begin(), dbc_names.end());
+
+  printf("%-52s %10s\n", "DBC", "PARSE_MS");
+  uint64_t total_ns = 0;
+  for (const auto &name : dbc_names) {
+    uint64_t start = now_ns();
+    DBC *dbc = dbc_parse(std::string(DBC_FILE_PATH) + "/" + name + ".dbc");
+    uint64_t elapsed = now_ns() - start;
+    total_ns += elapsed;
+    printf("%-52s %10.2f\n", name.c_str(), elapsed / 1e6);
+    delete dbc;
+  }
+  printf("%-52s %10.2f\n", "serial total", total_ns / 1e6);
+
+  std::vector<std::thread> threads;
+  uint64_t start = now_ns();
+  for (const auto &name : dbc_names) {
+    threads.emplace_back([&name]() { dbc_lookup(name); });
+  }
+  for (auto &t : threads) t.join();
+  printf("%-52s %10.2f\n", "dbc_lookup, one thread per DBC", (now_ns() - start) / 1e6);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "--startup") == 0) {
+    return startup();
+  }
+  if (argc > 1 && strcmp(argv[1], "--replay") == 0) {
+    if (argc < 4) {
+      fprintf(stderr, "usage: %s --replay <rlog> <dbc name> [bus]\n", argv[0]);
+      return 1;
+    }
+    return replay(argv[2], argv[3], argc > 4 ? std::atoi(argv[4]) : 0);
+  }
+
+  std::vector<std::string> dbc_names = argc > 1 ? std::vector<std::string>{argv[1]} : get_dbc_names();
+  int iterations = argc > 2 ? std::atoi(argv[2]) : 10000;
+  std::sort(dbc_names.begin(), dbc_names.end());
+
+  std::mt19937 rng(0);
+  int mismatches = 0;
+  printf("%-52s %5s %7s %12s %12s %8s %13s\n", "DBC", "MSGS", "SIGNALS", "LEGACY_NS", "COMPILED_NS", "SPEEDUP", "GENERATED_NS");
+  for (const auto &name : dbc_names) {
+    const DBC *dbc = dbc_lookup(name);
+    if (dbc == nullptr || dbc->msgs.empty()) continue;
+
+    std::vector<BenchMessage> msgs(dbc->msgs.size());
+    size_t num_signals = 0;
+    for (int i = 0; i < dbc->msgs.size(); i++) {
+      const Msg &msg = dbc->msgs[i];
+      MessageState &state = msgs[i].state;
+      state.address = msg.address;
+      state.size = msg.size;
+      state.ignore_checksum = state.ignore_counter = true;
+      state.parse_sigs = msg.sigs;
+      state.vals.resize(msg.sigs.size());
+      state.compile();
+      msgs[i].all_vals.resize(msg.sigs.size());
+      num_signals += msg.sigs.size();
+
+      for (int p = 0; p < 16; p++) {
+        auto &dat = msgs[i].payloads.emplace_back(std::min(msg.size, 64u));
+        for (auto &b : dat) b = rng();
+      }
+    }
+
+    double legacy = bench_legacy(msgs, iterations);
+    double compiled = bench_compiled(msgs, iterations);
+    printf("%-52s %5zu %7zu %12.1f %12.1f %7.2fx", name.c_str(), msgs.size(), num_signals, legacy, compiled, legacy / compiled);
+
+    int num_generated = 0;
+    for (int i = 0; i < dbc->msgs.size(); i++) {
+      const GeneratedMsg *generated = generated_msg_lookup(dbc->name, dbc->msgs[i]);
+      if (generated == nullptr) continue;
+      num_generated++;
+
+      MessageState &state = msgs[i].state;
+      for (const auto &dat : msgs[i].payloads) {
+        state.compile();
+        state.parse(0, dat);
+        std::vector<double> expected = state.vals;
+        state.compile(generated);
+        state.parse(0, dat);
+        if (state.vals != expected) {
+          fprintf(stderr, "\n%s: generated decoder for 0x%X differs\n", name.c_str(), state.address);
+          mismatches++;
+          break;
+        }
+      }
+    }
+    if (num_generated > 0) {
+      printf(" %13.1f\n", bench_compiled(msgs, iterations));
+    } else {
+      printf(" %13s\n", "-");
+    }
+  }
+  return mismatches == 0 ? 0 : 1;
+}
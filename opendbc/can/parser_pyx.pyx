@@ -1,7 +1,6 @@
 # distutils: language = c++
 # cython: c_string_encoding=ascii, language_level=3
 
-from cython.operator cimport dereference as deref, preincrement as preinc
 from libcpp.pair cimport pair
 from libcpp.string cimport string
 from libcpp.vector cimport vector
@@ -9,7 +8,7 @@ from libcpp.unordered_set cimport unordered_set
 from libc.stdint cimport uint32_t
 
 from .common cimport CANParser as cpp_CANParser
-from .common cimport dbc_lookup, SignalValue, DBC
+from .common cimport dbc_lookup, MessageValues, DBC
 
 import numbers
 from collections import defaultdict
@@ -19,7 +18,8 @@ cdef class CANParser:
   cdef:
     cpp_CANParser *can
     const DBC *dbc
-    vector[SignalValue] can_values
+    vector[MessageValues] can_values
+    list signal_names
 
   cdef readonly:
     dict vl
@@ -38,6 +38,7 @@ cdef class CANParser:
     self.ts_nanos = {}
     msg_name_to_address = {}
     address_to_msg_name = {}
+    address_to_sig_names = {}
 
     for i in range(self.dbc[0].msgs.size()):
       msg = self.dbc[0].msgs[i]
@@ -45,6 +46,7 @@ cdef class CANParser:
 
       msg_name_to_address[name] = msg.address
       address_to_msg_name[msg.address] = name
+      address_to_sig_names[msg.address] = [sig.name.decode("utf8") for sig in msg.sigs]
 
       self.vl[msg.address] = {}
       self.vl[name] = self.vl[msg.address]
@@ -63,6 +65,10 @@ cdef class CANParser:
       message_v.push_back((address, c[1]))
 
     self.can = new cpp_CANParser(bus, dbc_name, message_v)
+
+    # can_values has one entry per tracked message, names are decoded once here
+    self.can.query_latest(self.can_values, 0)
+    self.signal_names = [address_to_sig_names[self.can_values[i].address] for i in range(self.can_values.size())]
     self.update_strings([])
 
   def update_strings(self, strings, sendcan=False):
@@ -70,21 +76,25 @@ cdef class CANParser:
       for l in v.values():  # no-cython-lint
         l.clear()
 
-    cdef vector[SignalValue] new_vals
     cdef unordered_set[uint32_t] updated_addrs
-
-    self.can.update_strings(strings, new_vals, sendcan)
-    cdef vector[SignalValue].iterator it = new_vals.begin()
-    cdef SignalValue* cv
-    while it != new_vals.end():
-      cv = &deref(it)
-      # Cast char * directly to unicode
-      cv_name = <unicode>cv.name
-      self.vl[cv.address][cv_name] = cv.value
-      self.vl_all[cv.address][cv_name] = cv.all_values
-      self.ts_nanos[cv.address][cv_name] = cv.ts_nanos
-      updated_addrs.insert(cv.address)
-      preinc(it)
+    cdef MessageValues* mv
+
+    self.can.update_strings(strings, self.can_values, sendcan)
+    for i in range(self.can_values.size()):
+      mv = &self.can_values[i]
+      if not mv.updated:
+        continue
+
+      vl = self.vl[mv.address]
+      vl_all = self.vl_all[mv.address]
+      ts_nanos = self.ts_nanos[mv.address]
+      names = self.signal_names[i]
+      for j in range(mv.values.size()):
+        name = names[j]
+        vl[name] = mv.values[j]
+        vl_all[name] = mv.all_values[j]
+        ts_nanos[name] = mv.ts_nanos
+      updated_addrs.insert(mv.address)
 
     return updated_addrs
 
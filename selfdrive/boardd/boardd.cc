@@ -22,6 +22,8 @@
 
 #include "cereal/gen/cpp/car.capnp.h"
 #include "cereal/messaging/messaging.h"
+#include "cereal/messaging/trace.h"
+#include "cereal/services.h"
 #include "common/params.h"
 #include "common/ratekeeper.h"
 #include "common/swaglog.h"
@@ -229,6 +231,7 @@ void can_send_thread(std::vector<Panda *> pandas, bool fake_send) {
 
     capnp::FlatArrayMessageReader cmsg(aligned_buf.align(msg.get()));
     cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+    trace_receive((int)ServiceId::sendcan, event.getLogMonoTime());
 
     // Don't send if older than 1 second
     if ((nanos_since_boot() - event.getLogMonoTime() < 1e9) && !fake_send) {
@@ -251,6 +254,7 @@ void can_recv_thread(std::vector<Panda *> pandas) {
   // run at 100Hz
   RateKeeper rk("boardd_can_recv", 100);
   std::vector<can_frame> raw_can_data;
+  PooledMessageBuilder msg_pool;
 
   while (!do_exit && check_all_connected(pandas)) {
     bool comms_healthy = true;
@@ -259,7 +263,7 @@ void can_recv_thread(std::vector<Panda *> pandas) {
       comms_healthy &= panda->can_receive(raw_can_data);
     }
 
-    MessageBuilder msg;
+    MessageBuilder &msg = msg_pool.reset();
     auto evt = msg.initEvent();
     evt.setValid(comms_healthy);
     auto canData = evt.initCan(raw_can_data.size());
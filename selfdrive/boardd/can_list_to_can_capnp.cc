@@ -2,7 +2,9 @@
 #include "panda.h"
 
 void can_list_to_can_capnp_cpp(const std::vector<can_frame> &can_list, std::string &out, bool sendCan, bool valid) {
-  MessageBuilder msg;
+  // Called for every sendcan from controlsd, reuse the builder
+  static thread_local PooledMessageBuilder msg_pool;
+  MessageBuilder &msg = msg_pool.reset();
   auto event = msg.initEvent(valid);
 
   auto canData = sendCan ? event.initSendcan(can_list.size()) : event.initCan(can_list.size());
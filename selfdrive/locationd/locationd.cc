@@ -605,8 +605,8 @@ void Localizer::handle_msg(const cereal::Event::Reader& log) {
   this->update_reset_tracker();
 }
 
-kj::ArrayPtr<capnp::byte> Localizer::get_message_bytes(MessageBuilder& msg_builder, bool inputsOK,
-                                                       bool sensorsOK, bool gpsOK, bool msgValid) {
+void Localizer::build_message(MessageBuilder& msg_builder, bool inputsOK,
+                              bool sensorsOK, bool gpsOK, bool msgValid) {
   cereal::Event::Builder evt = msg_builder.initEvent();
   evt.setValid(msgValid);
   cereal::LiveLocationKalman::Builder liveLoc = evt.initLiveLocationKalman();
@@ -614,7 +614,6 @@ kj::ArrayPtr<capnp::byte> Localizer::get_message_bytes(MessageBuilder& msg_build
   liveLoc.setSensorsOK(sensorsOK);
   liveLoc.setGpsOK(gpsOK);
   liveLoc.setInputsOK(inputsOK);
-  return msg_builder.toBytes();
 }
 
 bool Localizer::is_gps_ok() {
@@ -688,6 +687,7 @@ int Localizer::locationd_thread() {
   // TODO: remove carParams once we're always sending at 100Hz
   SubMaster sm(service_list, {}, nullptr, {gps_location_socket, "carParams"});
   PubMaster pm({"liveLocationKalman"});
+  PooledMessageBuilder msg_pool;
 
   uint64_t cnt = 0;
   bool filterInitialized = false;
@@ -722,9 +722,9 @@ int Localizer::locationd_thread() {
         this->ttff = std::max(1e-3, (sm[trigger_msg].getLogMonoTime() * 1e-9) - this->first_valid_log_time);
       }
 
-      MessageBuilder msg_builder;
-      kj::ArrayPtr<capnp::byte> bytes = this->get_message_bytes(msg_builder, inputsOK, sensorsOK, gpsOK, filterInitialized);
-      pm.send("liveLocationKalman", bytes.begin(), bytes.size());
+      MessageBuilder &msg_builder = msg_pool.reset();
+      this->build_message(msg_builder, inputsOK, sensorsOK, gpsOK, filterInitialized);
+      pm.send("liveLocationKalman", msg_builder);
 
       if (cnt % 1200 == 0 && gpsOK) {  // once a minute
         VectorXd posGeo = this->get_position_geodetic();
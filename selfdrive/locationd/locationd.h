@@ -44,7 +44,7 @@ public:
   bool are_inputs_ok();
   void observation_timings_invalid_reset();
 
-  kj::ArrayPtr<capnp::byte> get_message_bytes(MessageBuilder& msg_builder,
+  void build_message(MessageBuilder& msg_builder,
     bool inputsOK, bool sensorsOK, bool gpsOK, bool msgValid);
   void build_live_location(cereal::LiveLocationKalman::Builder& fix);
 
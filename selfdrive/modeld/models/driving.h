@@ -288,6 +288,7 @@ struct PublishState {
   std::array<float, DISENGAGE_LEN * DISENGAGE_LEN> disengage_buffer = {};
   std::array<float, 5> prev_brake_5ms2_probs = {};
   std::array<float, 3> prev_brake_3ms2_probs = {};
+  PooledMessageBuilder model_msg;
 };
 
 void model_init(ModelState* s, cl_device_id device_id, cl_context context);
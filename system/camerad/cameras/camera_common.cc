@@ -133,6 +133,16 @@ bool CameraBuf::acquire() {
     cur_frame_data.timestamp_sof,
     cur_frame_data.timestamp_eof,
   };
+  extra.meta.version = VISIONIPC_META_VERSION;
+  extra.meta.flags = cur_frame_data.high_conversion_gain ? VISIONIPC_META_HIGH_CONVERSION_GAIN : 0;
+  extra.meta.integ_lines = cur_frame_data.integ_lines;
+  extra.meta.gain = cur_frame_data.gain;
+  extra.meta.measured_grey_fraction = cur_frame_data.measured_grey_fraction;
+  extra.meta.target_grey_fraction = cur_frame_data.target_grey_fraction;
+  extra.meta.processing_time = cur_frame_data.processing_time;
+  extra.meta.crop_w = rgb_width;
+  extra.meta.crop_h = rgb_height;
+  extra.meta.transform[0] = extra.meta.transform[4] = extra.meta.transform[8] = 1.0;
   cur_yuv_buf->set_frame_id(cur_frame_data.frame_id);
   vipc_server->send(cur_yuv_buf, &extra);
 
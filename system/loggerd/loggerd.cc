@@ -61,6 +61,7 @@ struct RemoteEncoder {
   bool recording = false;
   bool marked_ready_to_rotate = false;
   bool seen_first_packet = false;
+  PooledMessageBuilder idx_msg;
 };
 
 int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct RemoteEncoder &re, const EncoderInfo &encoder_info) {
@@ -139,11 +140,11 @@ int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct
     }
 
     // put it in log stream as the idx packet
-    MessageBuilder bmsg;
+    MessageBuilder &bmsg = re.idx_msg.reset();
     auto evt = bmsg.initEvent(event.getValid());
     evt.setLogMonoTime(event.getLogMonoTime());
     (evt.*(encoder_info.set_encode_idx_func))(idx);
-    auto new_msg = bmsg.toBytes();
+    auto new_msg = re.idx_msg.toBytes();
     logger_log(&s->logger, (uint8_t *)new_msg.begin(), new_msg.size(), true);   // always in qlog?
     bytes_count += new_msg.size();
 
@@ -236,6 +237,8 @@ void loggerd_thread() {
   }
 
   uint64_t msg_count = 0, bytes_count = 0;
+  std::vector<MessageView> batch;
+  std::vector<uint8_t> batch_buf;
   double start_ts = millis_since_boot();
   while (!do_exit) {
     // poll for new messages on all sockets
@@ -248,18 +251,46 @@ void loggerd_thread() {
       }
 
       // drain socket
+      if (!service.encoder) {
+        // take everything pending in one pass, and copy it out before logging
+        // so a publisher lapping us can't change the data while it's being written
+        size_t count = sock->receiveBatch(&batch, 200);
+        batch_buf.clear();
+        for (size_t i = 0; i < count; i++) {
+          batch_buf.insert(batch_buf.end(), batch[i].data, batch[i].data + batch[i].size);
+        }
+        if (count > 0 && !sock->leaseValid()) {
+          LOGE("%s: dropping %zu messages, overwritten while draining", service.name.c_str(), count);
+          continue;
+        }
+
+        uint8_t *data = batch_buf.data();
+        for (size_t i = 0; i < count; i++) {
+          const bool in_qlog = service.freq != -1 && (service.counter++ % service.freq == 0);
+          logger_log(&s.logger, data, batch[i].size, in_qlog);
+          data += batch[i].size;
+          bytes_count += batch[i].size;
+
+          rotate_if_needed(&s);
+
+          if ((++msg_count % 1000) == 0) {
+            double seconds = (millis_since_boot() - start_ts) / 1000.0;
+            LOGD("%" PRIu64 " messages, %.2f msg/sec, %.2f KB/sec", msg_count, msg_count / seconds, bytes_count * 0.001 / seconds);
+          }
+        }
+
+        if (count >= 200) {
+          LOGD("large volume of '%s' messages", service.name.c_str());
+        }
+        continue;
+      }
+
       int count = 0;
       Message *msg = nullptr;
       while (!do_exit && (msg = sock->receive(true))) {
-        const bool in_qlog = service.freq != -1 && (service.counter++ % service.freq == 0);
-        if (service.encoder) {
-          s.last_camera_seen_tms = millis_since_boot();
-          bytes_count += handle_encoder_msg(&s, msg, service.name, remote_encoders[sock], encoder_infos_dict[service.name]);
-        } else {
-          logger_log(&s.logger, (uint8_t *)msg->getData(), msg->getSize(), in_qlog);
-          bytes_count += msg->getSize();
-          delete msg;
-        }
+        service.counter++;
+        s.last_camera_seen_tms = millis_since_boot();
+        bytes_count += handle_encoder_msg(&s, msg, service.name, remote_encoders[sock], encoder_infos_dict[service.name]);
 
         rotate_if_needed(&s);
 
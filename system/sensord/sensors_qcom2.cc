@@ -33,6 +33,7 @@ void interrupt_loop(std::vector<Sensor *>& sensors,
                     std::map<Sensor*, std::string>& sensor_service)
 {
   PubMaster pm_int({"gyroscope", "accelerometer"});
+  PooledMessageBuilder msg_pool;
 
   int fd = sensors[0]->gpio_fd;
   struct pollfd fd_list[1] = {0};
@@ -69,7 +70,7 @@ void interrupt_loop(std::vector<Sensor *>& sensors,
     uint64_t ts = evdata[num_events - 1].timestamp - offset;
 
     for (Sensor *sensor : sensors) {
-      MessageBuilder msg;
+      MessageBuilder &msg = msg_pool.reset();
       if (!sensor->get_event(msg, ts)) {
         continue;
       }
@@ -168,11 +169,12 @@ int sensor_loop(I2CBus *i2c_bus_imu) {
                                    std::ref(sensor_service));
 
   RateKeeper rk("sensord", 100);
+  PooledMessageBuilder msg_pool;
 
   // polling loop for non interrupt handled sensors
   while (!do_exit) {
     for (Sensor *sensor : sensors) {
-      MessageBuilder msg;
+      MessageBuilder &msg = msg_pool.reset();
       if (!sensor->get_event(msg)) {
         continue;
       }